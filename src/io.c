@@ -0,0 +1,446 @@
+#include "lwpint.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// I/O reactor
+// lwp_read() and friends try the call without blocking first; if it
+// would block they join the fd's waiters, arm a one-shot epoll
+// registration for it, park the calling thread, and retry when the
+// reactor reports the fd ready.
+// lwp_sleep() parks on a timer instead (timer.c). Only the LWP blocks;
+// its worker goes on running others.
+//
+// There is one epoll instance for the whole process. Workers poll it
+// without blocking every REACTOR_INTERVAL yields, and block in it (up to
+// the next timer) when they have nothing else to run, so that an idle
+// program sleeps in epoll_wait() rather than exiting; either way they
+// expire the timers that are due afterwards. An eventfd in the set lets
+// lwp_unpark() from elsewhere, or a new earlier timer, interrupt that.
+//
+// Each fd has a list of threads waiting to read and one of threads
+// waiting to write, in a table indexed by fd, and is registered for
+// whatever its waiters between them want. When it reports ready, every
+// waiter on the side(s) that became ready is woken to retry; the
+// registration is one-shot, so it's rearmed for anyone left. A waiter's
+// record lives on its own stack and is only valid until it's marked
+// ready, so pollers read the thread and the next record out of it first.
+//
+// Registrations are left in place (disarmed) when nobody is waiting,
+// and rearmed with EPOLL_CTL_MOD next time.
+//
+// The fd's own flags are left alone where possible: sockets are tried
+// with MSG_DONTWAIT, and anything else is made O_NONBLOCK for just the
+// one attempt (with preemption masked, and under nonblock_lock so no
+// two attempts overlap) and then put back, since the open file may be
+// shared with other processes (a terminal, say). A process that changes
+// the flags itself meanwhile can still race with that.
+
+typedef struct io_waiter {
+    thread           t;
+    int              ready;
+    struct io_waiter *next;
+} io_waiter;
+
+typedef struct io_fd {
+    io_waiter *readers;
+    io_waiter *writers;
+    int        registered;  // epoll has it, armed or not
+} io_fd;
+
+static int epfd = -1;
+static int wakefd = -1;
+static int waiting = 0;  // threads parked on fds (atomic)
+static int polling = 0;  // workers blocked in epoll_wait() (atomic)
+static io_fd *fds = NULL;  // indexed by fd
+static int nfds = 0;
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void io_enter(void) {
+    lwp_preempt_disable();
+    pthread_mutex_lock(&io_lock);
+}
+
+static void io_leave(void) {
+    pthread_mutex_unlock(&io_lock);
+    lwp_preempt_enable();
+}
+
+// Creates the epoll instance the first time anything needs it
+static int io_init(void) {
+    struct epoll_event ev;
+
+    if (__atomic_load_n(&epfd, __ATOMIC_ACQUIRE) >= 0) {
+        return 0;
+    }
+    io_enter();
+    if (epfd < 0) {
+        int ep = epoll_create1(EPOLL_CLOEXEC);
+        if (ep >= 0) {
+            wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            ev.events = EPOLLIN;
+            ev.data.fd = wakefd;
+            if (wakefd < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, wakefd, &ev) < 0) {
+                if (wakefd >= 0) close(wakefd);
+                close(ep);
+                ep = -1;
+            }
+        }
+        __atomic_store_n(&epfd, ep, __ATOMIC_RELEASE);
+    }
+    io_leave();
+    return epfd >= 0 ? 0 : -1;
+}
+
+// Makes room in the table for fd. Called with the lock held.
+static int fds_grow(int fd) {
+    int n = nfds ? nfds : 64;
+    io_fd *grown;
+
+    while (n <= fd) {
+        n *= 2;
+    }
+    grown = realloc(fds, n * sizeof(io_fd));
+    if (grown == NULL) {
+        return -1;
+    }
+    memset(grown + nfds, 0, (n - nfds) * sizeof(io_fd));
+    fds = grown;
+    nfds = n;
+    return 0;
+}
+
+// Arms fd's one-shot registration for whatever its waiters want, adding
+// it to the epoll set if it isn't there (any more: closing an fd takes it
+// out). Called with the lock held.
+static int fd_arm(int fd) {
+    io_fd *f = &fds[fd];
+    struct epoll_event ev;
+
+    ev.events = EPOLLONESHOT;
+    if (f->readers != NULL) {
+        ev.events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (f->writers != NULL) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = fd;
+    if (f->registered && epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+        return 0;
+    }
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0 &&
+        (errno != EEXIST || epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0)) {
+        return -1;
+    }
+    f->registered = TRUE;
+    return 0;
+}
+
+// Marks w ready and wakes its thread
+static void waiter_ready(io_waiter *w) {
+    thread t = w->t;
+    thread_pin(t);  // it may be gone once it sees ready
+    __atomic_store_n(&w->ready, TRUE, __ATOMIC_RELEASE);
+    lwp_unpark(t);
+    thread_unpin(t);
+}
+
+static void waiter_park(io_waiter *w) {
+    while (!__atomic_load_n(&w->ready, __ATOMIC_ACQUIRE)) {
+        lwp_park();
+    }
+    __atomic_sub_fetch(&waiting, 1, __ATOMIC_RELAXED);
+}
+
+int io_pending(void) {
+    return __atomic_load_n(&waiting, __ATOMIC_RELAXED) != 0 || timer_pending();
+}
+
+
+int io_polling(void) {
+    return __atomic_load_n(&polling, __ATOMIC_SEQ_CST) != 0;
+}
+
+
+void io_wake(void) {
+    unsigned long long one = 1;
+    if (wakefd >= 0 && write(wakefd, &one, sizeof(one)) < 0) {
+        // already signalled (the counter is full); that will do
+    }
+}
+
+
+// Moves every waiter on list onto the front of onto
+static io_waiter *waiters_join(io_waiter *list, io_waiter *onto) {
+    io_waiter *next;
+
+    for (; list != NULL; list = next) {
+        next = list->next;
+        list->next = onto;
+        onto = list;
+    }
+    return onto;
+}
+
+// Wakes fd's waiters on whichever side(s) events says are ready, and
+// rearms it for the rest. Returns how many it woke.
+static int fd_ready(int fd, unsigned int events) {
+    io_waiter *ready = NULL, *w, *next;
+    io_fd *f;
+    int woken = 0;
+
+    io_enter();
+    f = &fds[fd];
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        ready = waiters_join(f->readers, ready);
+        f->readers = NULL;
+    }
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        ready = waiters_join(f->writers, ready);
+        f->writers = NULL;
+    }
+    if ((f->readers != NULL || f->writers != NULL) && fd_arm(fd) < 0) {
+        // Only if fd was closed under them; let them retry and find out
+        ready = waiters_join(f->readers, waiters_join(f->writers, ready));
+        f->readers = f->writers = NULL;
+    }
+    io_leave();
+
+    for (w = ready; w != NULL; w = next) {
+        next = w->next;
+        waiter_ready(w);
+        woken++;
+    }
+    return woken;
+}
+
+
+// Waits up to max_ms (no limit if negative, but never past the next
+// timer) for fds to become ready, and wakes their threads and those of
+// any timers that are due. Returns how many threads it woke.
+int io_poll(int max_ms) {
+    struct epoll_event events[64];
+    int timeout = max_ms, woken = 0, next, n, i;
+
+    if (epfd < 0 && (!timer_pending() || io_init() < 0)) {
+        return 0;
+    }
+
+    next = timer_next_ms();
+    if (next >= 0 && (timeout < 0 || next < timeout)) {
+        timeout = next;
+    }
+
+    if (timeout != 0) {
+        __atomic_add_fetch(&polling, 1, __ATOMIC_SEQ_CST);
+    }
+    n = epoll_wait(epfd, events, 64, timeout);
+    if (timeout != 0) {
+        __atomic_sub_fetch(&polling, 1, __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < n; i++) {
+        if (events[i].data.fd == wakefd) {
+            unsigned long long count;
+            if (read(wakefd, &count, sizeof(count)) < 0) {
+                // raced with another poller for it
+            }
+        } else {
+            woken += fd_ready(events[i].data.fd, events[i].events);
+        }
+    }
+
+    return woken + timer_expire();
+}
+
+
+// Parks the calling thread until fd is ready for reading or, if writing,
+// writing. Returns -1 (with errno set) if fd can't be polled, e.g. a
+// regular file.
+static int io_wait(int fd, int writing) {
+    io_waiter w, **side;
+
+    if (io_init() < 0) {
+        return -1;
+    }
+    w.t = lwp_self();
+    w.ready = FALSE;
+
+    io_enter();
+    if (fd >= nfds && fds_grow(fd) < 0) {
+        io_leave();
+        errno = ENOMEM;
+        return -1;
+    }
+    side = writing ? &fds[fd].writers : &fds[fd].readers;
+    w.next = *side;
+    *side = &w;
+    if (fd_arm(fd) < 0) {
+        *side = w.next;
+        io_leave();
+        return -1;
+    }
+    __atomic_add_fetch(&waiting, 1, __ATOMIC_RELAXED);
+    io_leave();
+
+    waiter_park(&w);
+    return 0;
+}
+
+// The O_NONBLOCK flag belongs to the open file, which other fds and
+// other workers may share, so setting it, making the call, and putting
+// it back is done under one lock. Otherwise a second caller could find
+// it set by the first, leave it alone on the way out, and then block
+// its whole worker in read() once the first had put it back.
+static pthread_mutex_t nonblock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Makes fd non-blocking for one call, returning the flags to put back
+// with nonblock_end(), or -1
+static int nonblock_begin(int fd) {
+    int flags;
+
+    lwp_preempt_disable();
+    pthread_mutex_lock(&nonblock_lock);
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || (!(flags & O_NONBLOCK) &&
+                      fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        pthread_mutex_unlock(&nonblock_lock);
+        lwp_preempt_enable();
+        return -1;
+    }
+    return flags;
+}
+
+static void nonblock_end(int fd, int flags) {
+    int saved = errno;
+
+    if (!(flags & O_NONBLOCK)) {
+        fcntl(fd, F_SETFL, flags);
+    }
+    pthread_mutex_unlock(&nonblock_lock);
+    errno = saved;
+    lwp_preempt_enable();
+}
+
+// One attempt at read(2) that doesn't block
+static ssize_t try_read(int fd, void *buf, size_t count) {
+    ssize_t r = recv(fd, buf, count, MSG_DONTWAIT);
+    int flags;
+
+    if (r < 0 && errno == ENOTSOCK) {
+        if ((flags = nonblock_begin(fd)) < 0) {
+            return -1;
+        }
+        r = read(fd, buf, count);
+        nonblock_end(fd, flags);
+    }
+    return r;
+}
+
+// One attempt at write(2) that doesn't block
+static ssize_t try_write(int fd, const void *buf, size_t count) {
+    ssize_t r = send(fd, buf, count, MSG_DONTWAIT);
+    int flags;
+
+    if (r < 0 && errno == ENOTSOCK) {
+        if ((flags = nonblock_begin(fd)) < 0) {
+            return -1;
+        }
+        r = write(fd, buf, count);
+        nonblock_end(fd, flags);
+    }
+    return r;
+}
+
+// One attempt at accept(2) that doesn't block
+static int try_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    int flags, r;
+
+    if ((flags = nonblock_begin(fd)) < 0) {
+        return -1;
+    }
+    r = accept(fd, addr, addrlen);
+    nonblock_end(fd, flags);
+    return r;
+}
+
+// True if the last call failed only because it would have blocked
+#define WOULD_BLOCK() (errno == EAGAIN || errno == EWOULDBLOCK)
+
+
+// Like read(2), but only the calling LWP waits for data
+ssize_t lwp_read(int fd, void *buf, size_t count) {
+    ssize_t r;
+
+    if (lwp_self() == NULL) {
+        return read(fd, buf, count);
+    }
+    while ((r = try_read(fd, buf, count)) < 0 &&
+           (WOULD_BLOCK() || errno == EINTR)) {
+        if (errno != EINTR && io_wait(fd, FALSE) < 0) {
+            return -1;
+        }
+    }
+    return r;
+}
+
+
+// Like write(2), but only the calling LWP waits for room
+ssize_t lwp_write(int fd, const void *buf, size_t count) {
+    ssize_t r;
+
+    if (lwp_self() == NULL) {
+        return write(fd, buf, count);
+    }
+    while ((r = try_write(fd, buf, count)) < 0 &&
+           (WOULD_BLOCK() || errno == EINTR)) {
+        if (errno != EINTR && io_wait(fd, TRUE) < 0) {
+            return -1;
+        }
+    }
+    return r;
+}
+
+
+// Like accept(2), but only the calling LWP waits for a connection. The
+// new fd is as accept(2) makes it.
+int lwp_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    int r;
+
+    if (lwp_self() == NULL) {
+        return accept(fd, addr, addrlen);
+    }
+    while ((r = try_accept(fd, addr, addrlen)) < 0 &&
+           (WOULD_BLOCK() || errno == EINTR)) {
+        if (errno != EINTR && io_wait(fd, FALSE) < 0) {
+            return -1;
+        }
+    }
+    return r;
+}
+
+
+// Parks the calling LWP for at least usec microseconds (rounded up to
+// whole milliseconds)
+void lwp_sleep(unsigned long usec) {
+    lwp_timer tm;
+
+    if (lwp_self() == NULL || io_init() < 0) {
+        struct timespec ts;
+        ts.tv_sec = usec / 1000000;
+        ts.tv_nsec = (usec % 1000000) * 1000;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+        return;
+    }
+    timer_start(&tm, usec);
+    while (!__atomic_load_n(&tm.fired, __ATOMIC_ACQUIRE)) {
+        lwp_park();
+    }
+}
@@ -1,203 +1,1722 @@
 #include "lwp.h"
+#include "lwpint.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <ucontext.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
-
-#define MAX_QUEUE_SIZE 100
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
 
 static tid_t next_tid = 1;  // Unique thread ID counter
-static thread current_thread = NULL;
-static scheduler current_sched = NULL;
 
-// Simple queue to manage blocked threads
-typedef struct thread_queue {
-    thread *threads;  // Array or list of threads
-    int front;        // Index of the front of the queue
-    int rear;         // Index of the rear of the queue
-    int capacity;     // Maximum capacity of the queue
-    int size;         // Current size of the queue
-} thread_queue;
+// Workers: each kernel thread that runs LWPs has one of these. Normally
+// there is only boot_worker, the calling thread; lwp_set_workers(n)
+// makes lwp_start() add n-1 more, each with its own run queue (the
+// scheduler's state is per kernel thread) and its own current thread.
+typedef struct worker {
+    int             id;          // index into workers[]
+    thread          current;     // the thread running here right now
+    thread          prev;        // thread we just switched away from
+    thread          idle;        // runs when nothing else here can
+    pthread_t       pthread;
+    thread          inbox;       // made runnable from elsewhere; a
+                                 // lock-free LIFO linked through wake_next
+    int             wake_seq;    // futex word, bumped by every push
+    int             sleeping;    // SLEEP_FUTEX or SLEEP_REACTOR, or 0
+    volatile int    preempt_pending;  // a tick arrived while masked
+    timer_t         timer;       // per-worker preemption timer
+    int             has_timer;
+    unsigned long   quantum;     // what timer is armed with (usec)
+    thread          runnext;     // handed off to; runs before next()
+    thread          direct;      // current thread, taken from runnext
+                                 // and not on the run queue yet
+    int             handoffs;    // runnext picks since the last next()
+    unsigned int    yields;      // counts to REACTOR_INTERVAL
+    unsigned long   switches;    // for lwp_stats()
+    int             runq_peak;   // longest qlen() seen here
+} worker;
+
+#define SLEEP_FUTEX   1  // in inbox_wait()
+#define SLEEP_REACTOR 2  // in source_wait() on the reactor
+#define SLEEP_HOOK    3  // in source_wait() on the idle policy's poll()
+
+static worker boot_worker = {
+    0, NULL, NULL, NULL, 0,
+    NULL, 0, FALSE,
+    FALSE, 0, FALSE, 0,
+    NULL, NULL, 0, 0,
+    0, 0
+};
+static worker **workers = NULL;
+static int nworkers = 1;          // how many lwp_start() runs
+static int multicore = FALSE;     // more than one worker is running
+static int next_placement = 0;    // where lwp_create() puts the next thread
+static lwp_idle idle_policy = {   // see lwp_set_idle()
+    LWP_IDLE_SPIN_NS, LWP_IDLE_LATENCY_US, NULL, NULL
+};
+static __thread worker *this_worker = NULL;  // NULL: not a worker
+
+// Kernel threads that aren't workers get the boot worker until
+// lwp_start(), since nothing runs before then, and outside_worker from
+// then on. Nothing is ever current on that, so preemption masking from
+// such a thread touches no LWP, reschedule() does nothing, and wakeups
+// go through the owning worker's inbox.
+static worker outside_worker;
+static worker *unbound = &boot_worker;
+
+// Returns the calling kernel thread's worker. This is deliberately not
+// inlined: a thread can resume on a different worker than it left, and
+// the compiler must not reuse a TLS address computed before a switch.
+static __attribute__((noinline)) worker *cur_worker(void) {
+    worker *w = this_worker;
+    return w != NULL ? w : unbound;
+}
+
+// Returns the worker whose run queue t belongs on
+static worker *worker_of(thread t) {
+    return multicore ? workers[t->home] : &boot_worker;
+}
+
+#define current_thread (cur_worker()->current)
+
+// Preemption masking. Library code that touches the run queue or shared
+// state runs with the current thread's preempt_off count raised; a timer
+// tick that lands inside is remembered in preempt_pending and honoured
+// on the way out. The count lives in the thread rather than the worker
+// because a thread can be switched out (and resumed elsewhere) while
+// it's raised.
+static void reschedule(void);
+
+static void preempt_off(void) {
+    thread t = current_thread;
+    if (t != NULL) {
+        t->preempt_off++;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+static void preempt_on(void) {
+    thread t = current_thread;
+    if (t != NULL) {
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        if (--t->preempt_off == 0 && cur_worker()->preempt_pending) {
+            reschedule();
+        }
+    }
+}
+
+// The library lock protects everything shared between workers (tids,
+// the thread table, slab, stack pool, and lwp_wait bookkeeping). It is
+// only taken once more than one worker is running, and is never held
+// across a context switch. Holding it also masks preemption, since the
+// next thread on this worker could want it too.
+static pthread_mutex_t lib_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LIB_LOCK()   do {                                               \
+        preempt_off();                                                  \
+        if (multicore) pthread_mutex_lock(&lib_lock);                   \
+    } while (0)
+#define LIB_UNLOCK() do {                                               \
+        if (multicore) pthread_mutex_unlock(&lib_lock);                 \
+        preempt_on();                                                   \
+    } while (0)
+
+// FIFO of blocked threads, linked through lib_one. A thread is only
+// ever on one of these at a time, and never while it is on a run queue.
+typedef struct thread_queue {
+    thread head;
+    thread tail;
+} thread_queue;
+
+// Appends t to the queue
+static void tq_push(thread_queue *q, thread t) {
+    t->lib_one = NULL;
+    if (q->tail) {
+        q->tail->lib_one = t;
+    } else {
+        q->head = t;
+    }
+    q->tail = t;
+}
+
+// Removes and returns the oldest thread on the queue, or NULL
+static thread tq_pop(thread_queue *q) {
+    thread t = q->head;
+    if (t) {
+        q->head = t->lib_one;
+        if (!q->head) q->tail = NULL;
+        t->lib_one = NULL;
+    }
+    return t;
+}
+
+// Takes t off the queue, if it's there. O(n), but only timeouts need it.
+static int tq_remove(thread_queue *q, thread t) {
+    thread prev = NULL, cur = q->head;
+
+    while (cur != NULL && cur != t) {
+        prev = cur;
+        cur = cur->lib_one;
+    }
+    if (cur == NULL) {
+        return FALSE;
+    }
+    if (prev) {
+        prev->lib_one = t->lib_one;
+    } else {
+        q->head = t->lib_one;
+    }
+    if (q->tail == t) q->tail = prev;
+    t->lib_one = NULL;
+    return TRUE;
+}
+
+// lwp_wait() bookkeeping. Exited threads that nobody has waited for yet
+// sit on the zombie list (oldest first, linked through `exited`); threads
+// waiting for one to appear are parked on `waiters`, or `timed_waiters`
+// if they'll give up after a while. Only the former count towards
+// waiter_count, since a timed waiter may yet go on to exit.
+static thread zombie_head = NULL;
+static thread zombie_tail = NULL;
+static thread_queue waiters = {NULL, NULL};
+static thread_queue timed_waiters = {NULL, NULL};
+static int live_count = 0;    // created or started, and not yet exited
+static int waiter_count = 0;  // live threads parked in lwp_wait, untimed
+static int parked_count = 0;  // threads in lwp_park() (atomic)
+static unsigned long spawn_count = 0;  // for lwp_stats(), under the lock
+static unsigned long reap_count = 0;
+static int stats_timing = FALSE;       // see lwp_set_stats()
+
+// Round Robin Scheduler
+// The run queue is intrusive: a circular doubly-linked list threaded
+// through each context's sched_one (next) and sched_two (prev) links, so
+// admit, remove, and next are all O(1) and never allocate. rr_remove
+// clears both links, so a thread is on the queue exactly when its
+// sched_one is non-NULL. The queue is per kernel thread, so with several
+// workers each one round-robins over its own threads.
+//
+// The same kind of list, given by its head, is how threads are passed
+// in bulk to and from a scheduler's admit_batch and drain (see lwp.h),
+// so RoundRobin does both by splicing.
+static __thread thread head = NULL;  // next thread to run
+static __thread int queue_length = 0;
+
+// Appends t to the circular list at *ring
+static void ring_add(thread *ring, thread t) {
+    if (!*ring) {  // First thread
+        t->sched_one = t->sched_two = t;
+        *ring = t;
+    } else {  // Insert at end, i.e. just before head
+        thread tail = (*ring)->sched_two;
+        tail->sched_one = t;
+        t->sched_two = tail;
+        t->sched_one = *ring;
+        (*ring)->sched_two = t;
+    }
+}
+
+// Appends the whole circular list at list to the one at *ring
+static void ring_splice(thread *ring, thread list) {
+    thread tail, list_tail;
+
+    if (!list) return;
+    if (!*ring) {
+        *ring = list;
+        return;
+    }
+    tail = (*ring)->sched_two;
+    list_tail = list->sched_two;
+    tail->sched_one = list;
+    list->sched_two = tail;
+    list_tail->sched_one = *ring;
+    (*ring)->sched_two = list_tail;
+}
+
+void rr_admit(thread new) {
+    ring_add(&head, new);
+    queue_length++;
+}
+
+
+void rr_admit_batch(thread list, int n) {
+    ring_splice(&head, list);
+    queue_length += n;
+}
+
+
+thread rr_drain(int *n) {
+    thread list = head;
+    *n = queue_length;
+    head = NULL;
+    queue_length = 0;
+    return list;
+}
+
+
+void rr_remove(thread victim) {
+    if (victim->sched_one == NULL) return;  // not queued
+
+    if (victim->sched_one == victim) {
+        head = NULL;  // Only one thread in the queue
+    } else {
+        victim->sched_two->sched_one = victim->sched_one;
+        victim->sched_one->sched_two = victim->sched_two;
+        if (head == victim) head = victim->sched_one;
+    }
+    victim->sched_one = victim->sched_two = NULL;
+    queue_length--;
+}
+
+
+thread rr_next(void) {
+    thread t = head;
+    if (!t) return NULL;
+    head = t->sched_one;  // It goes to the back of the line
+    return t;
+}
+
+
+int rr_qlen(void) {
+    return queue_length;
+}
+
+
+struct scheduler rr_publish = {
+    NULL, NULL, rr_admit, rr_remove, rr_next, rr_qlen, NULL,
+    rr_admit_batch, rr_drain
+};
+scheduler RoundRobin = &rr_publish;
+static scheduler current_sched = &rr_publish;
+
+
+// Admits a list of n threads (as for admit_batch) to s, a thread at a
+// time if s can't take them all at once
+static void sched_admit_batch(scheduler s, thread list, int n) {
+    if (s->admit_batch) {
+        s->admit_batch(list, n);
+        return;
+    }
+    while (n-- > 0) {
+        thread t = list, next = list->sched_one;
+        t->sched_one = t->sched_two = NULL;
+        s->admit(t);
+        list = next;
+    }
+}
+
+// Takes every thread off s and returns them as a list (as for drain),
+// with the count in *n. Without a drain hook that means taking them in
+// the order next() offers them, removing each as it comes.
+static thread sched_drain(scheduler s, int *n) {
+    thread list = NULL, t;
+
+    if (s->drain) {
+        return s->drain(n);
+    }
+    *n = 0;
+    while ((t = s->next()) != NULL) {
+        s->remove(t);
+        ring_add(&list, t);
+        (*n)++;
+    }
+    return list;
+}
+
+
+size_t get_stack_size() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY) {
+        return limit.rlim_cur;  // Soft limit
+    }
+    return LWP_DEFAULT_STACK;  // No usable limit
+}
+
+
+// Page size, looked up once
+static size_t get_page_size(void) {
+    static size_t page_size = 0;
+    if (page_size == 0) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+    return page_size;
+}
+
+
+// Rounds a requested stack size up to whole pages, at least LWP_MIN_STACK
+static size_t round_stack_size(size_t size) {
+    size_t page = get_page_size();
+    if (size < LWP_MIN_STACK) {
+        size = LWP_MIN_STACK;
+    }
+    return (size + page - 1) & ~(page - 1);
+}
+
+
+// Stack pool: stacks of exited threads are kept here and handed to the
+// next lwp_create() of the same size, so spawn/reap churn doesn't cost
+// an mmap/munmap pair per thread.
+//
+// Every stack is mapped with one guard page below it, so an overflow
+// faults immediately. The base/size recorded everywhere outside this
+// section is the usable part above the guard. Where the kernel has
+// MADV_GUARD_INSTALL (Linux 6.13), the guard is a marker in the page
+// tables rather than a PROT_NONE page, which saves splitting the mapping
+// in two (or, for a batch of stacks carved from one mapping, in 2n), and
+// so makes the guard itself and every later fault on the stack cheaper.
+// Elsewhere it falls back to mprotect().
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
+
+typedef struct pooled_stack {
+    unsigned long *base;
+    size_t size;
+} pooled_stack;
+
+static pooled_stack *pool = NULL;      // cached stacks, pool_count in use
+static size_t pool_count = 0;
+static size_t pool_max = 16;           // cache size (lwp_stack_pool_config)
+static int pool_trim = FALSE;          // madvise cached stacks away?
+static unsigned long pool_hits = 0;
+static unsigned long pool_misses = 0;
+static size_t default_stack_size = 0;  // get_stack_size(), looked up once
+static int guard_markers = TRUE;       // until MADV_GUARD_INSTALL fails
+
+// Makes the page at guard fault on any access
+static int guard_install(char *guard) {
+    size_t page = get_page_size();
+
+    if (guard_markers) {
+        if (madvise(guard, page, MADV_GUARD_INSTALL) == 0) {
+            return 0;
+        }
+        guard_markers = FALSE;  // an older kernel; don't ask again
+    }
+    return mprotect(guard, page, PROT_NONE);
+}
+
+// Gets a stack of the given size, from the pool if possible
+static unsigned long *stack_alloc(size_t size) {
+    size_t page = get_page_size();
+    size_t i;
+    char *map;
+
+    for (i = pool_count; i > 0; i--) {
+        if (pool[i - 1].size == size) {
+            unsigned long *stack = pool[i - 1].base;
+            pool[i - 1] = pool[--pool_count];
+            pool_hits++;
+            return stack;
+        }
+    }
+
+    pool_misses++;
+    map = mmap(
+        NULL,
+        size + page,
+        PROT_READ | PROT_WRITE,
+        MAP_ANONYMOUS | MAP_PRIVATE,
+        -1,
+        0
+    );
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    if (guard_install(map) < 0) {
+        munmap(map, size + page);
+        return NULL;
+    }
+    return (unsigned long *)(map + page);
+}
+
+// Gets up to n stacks of the given size into stacks[], from the pool
+// first and then carved out of one new mapping, each with a guard page
+// below it as usual. That saves a mmap() per stack, but each still needs
+// its guard and its own first-touch fault, so cold stacks cost nearly as
+// much this way; it's the pool that makes stacks cheap. Carved stacks
+// are released one at a time like any other, unmapping just their own
+// part. Returns how many it got.
+static int stack_alloc_many(size_t size, unsigned long **stacks, int n) {
+    size_t page = get_page_size();
+    size_t i;
+    int got = 0, carve;
+    char *map;
+
+    for (i = pool_count; i > 0 && got < n; i--) {
+        if (pool[i - 1].size == size) {
+            stacks[got++] = pool[i - 1].base;
+            pool[i - 1] = pool[--pool_count];
+            pool_hits++;
+        }
+    }
+    if (got == n) {
+        return got;
+    }
+
+    carve = n - got;
+    map = mmap(NULL, carve * (size + page), PROT_READ | PROT_WRITE,
+               MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (map == MAP_FAILED) {
+        return got;
+    }
+    for (; carve > 0; carve--) {
+        if (guard_install(map) < 0) {
+            munmap(map, carve * (size + page));
+            break;
+        }
+        pool_misses++;
+        stacks[got++] = (unsigned long *)(map + page);
+        map += size + page;
+    }
+    return got;
+}
+
+// Returns a stack to the pool, or unmaps it if the pool is full
+static void stack_release(unsigned long *stack, size_t size) {
+    if (pool == NULL && pool_max > 0) {
+        pool = malloc(pool_max * sizeof(pooled_stack));
+    }
+    if (pool == NULL || pool_count >= pool_max) {
+        munmap((char *)stack - get_page_size(), size + get_page_size());
+        return;
+    }
+
+    if (pool_trim) {
+        // Give the pages back but keep the mapping. The top page is
+        // the first one a new thread touches, so leave it resident.
+        size_t page = get_page_size();
+        if (size > page) {
+            madvise(stack, size - page, MADV_DONTNEED);
+        }
+    }
+    pool[pool_count].base = stack;
+    pool[pool_count].size = size;
+    pool_count++;
+}
+
+// Sets how many stacks the pool may hold and whether cached stacks are
+// trimmed with madvise(MADV_DONTNEED). Shrinking unmaps the excess.
+void lwp_stack_pool_config(size_t max_cached, int trim) {
+    pooled_stack *resized;
+
+    LIB_LOCK();
+    while (pool_count > max_cached) {
+        pool_count--;
+        munmap((char *)pool[pool_count].base - get_page_size(),
+               pool[pool_count].size + get_page_size());
+    }
+    if (max_cached == 0) {
+        free(pool);
+        pool = NULL;
+    } else if (pool != NULL) {
+        resized = realloc(pool, max_cached * sizeof(pooled_stack));
+        if (resized == NULL) {
+            LIB_UNLOCK();
+            return;  // keep the old size
+        }
+        pool = resized;
+    }
+    pool_max = max_cached;
+    pool_trim = trim;
+    LIB_UNLOCK();
+}
+
+// Reports pool hits, misses, and how many stacks are currently cached
+void lwp_stack_pool_stats(lwp_poolstats *stats) {
+    if (stats != NULL) {
+        stats->hits = pool_hits;
+        stats->misses = pool_misses;
+        stats->cached = pool_count;
+    }
+}
+
+
+// Growable stacks (LWP_GROWABLE): the whole stack is reserved PROT_NONE
+// and only the top stack_mapped bytes of it are made accessible. When
+// the thread runs into the rest, grow_handler() maps more, on the
+// worker's alternate signal stack since there's no room on the thread's
+// own. The page below the reservation is never mapped, so it's the
+// guard page, as for any other stack. A fault that isn't a growable
+// stack's goes to whatever SIGSEGV handler was there before.
+#define GROW_SLACK    (16*1024)  // mapped below the fault, for signal frames
+#define ALTSTACK_SIZE (64*1024)
+#define STACK_CANARY  0x5afec0de5afec0deUL  // see stack_mark()
+
+static struct sigaction grow_prev;  // the SIGSEGV handler we replaced
+static int grow_installed = FALSE;
+
+// Maps more of t's stack so that addr is in it. Returns FALSE if addr
+// isn't in the unmapped part of t's stack, or the mapping fails.
+static int grow_stack(thread t, char *addr) {
+    size_t page = get_page_size();
+    char *top, *low, *want;
+
+    if (t == NULL || t->stack_mapped == 0) {
+        return FALSE;
+    }
+    top = (char *)t->stack + t->stacksize;
+    low = top - t->stack_mapped;
+    if (addr >= low || addr < (char *)t->stack) {
+        return FALSE;
+    }
+    want = (char *)((unsigned long)addr & ~(page - 1)) - GROW_SLACK;
+    if ((size_t)(top - want) < 2 * t->stack_mapped) {
+        want = top - 2 * t->stack_mapped;
+    }
+    if (want < (char *)t->stack || want > top) {  // the latter: wrapped
+        want = (char *)t->stack;
+    }
+    if (mprotect(want, low - want, PROT_READ | PROT_WRITE) < 0) {
+        return FALSE;
+    }
+    // If the canary reached the bottom of what was mapped, carry it down
+    // through the new part, so the thread's real depth is still measured
+    if (t->stack_marked != 0 && t->stack_marked >= t->stack_mapped) {
+        unsigned long *p;
+        for (p = (unsigned long *)want; p < (unsigned long *)low; p++) {
+            *p = STACK_CANARY;
+        }
+        t->stack_marked = top - want;
+    }
+    t->stack_mapped = top - want;
+    return TRUE;
+}
+
+static void grow_handler(int sig, siginfo_t *info, void *uc) {
+    worker *w = cur_worker();
+
+    // prev: a fault in the middle of lwp_switch() is the old thread's
+    if (grow_stack(w->current, info->si_addr) ||
+        grow_stack(w->prev, info->si_addr)) {
+        return;  // and the faulting instruction tries again
+    }
+    if ((grow_prev.sa_flags & SA_SIGINFO) &&
+        grow_prev.sa_sigaction != NULL) {
+        grow_prev.sa_sigaction(sig, info, uc);
+    } else if (!(grow_prev.sa_flags & SA_SIGINFO) &&
+               grow_prev.sa_handler != SIG_DFL &&
+               grow_prev.sa_handler != SIG_IGN) {
+        grow_prev.sa_handler(sig);
+    } else {
+        // Put the default action back; the fault happens again on the
+        // way out and kills us as it would have
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+// Gives the calling kernel thread an alternate signal stack to grow
+// stacks from, unless it already has one
+static void grow_altstack(void) {
+    stack_t ss;
+
+    if (sigaltstack(NULL, &ss) == 0 && !(ss.ss_flags & SS_DISABLE)) {
+        return;
+    }
+    ss.ss_sp = malloc(ALTSTACK_SIZE);
+    ss.ss_size = ALTSTACK_SIZE;
+    ss.ss_flags = 0;
+    if (ss.ss_sp != NULL && sigaltstack(&ss, NULL) < 0) {
+        free(ss.ss_sp);
+    }
+}
+
+// Reserves a growable stack of the given size, with the top initial
+// bytes of it mapped, and installs grow_handler() if it's the first.
+// Called with the lock held.
+static unsigned long *grow_alloc(size_t size, size_t initial,
+                                 size_t *mapped) {
+    size_t page = get_page_size();
+    char *map;
+
+    if (initial > size) {
+        initial = size;
+    }
+
+    if (!grow_installed) {
+        struct sigaction sa;
+        sa.sa_sigaction = grow_handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+        if (sigaction(SIGSEGV, &sa, &grow_prev) < 0) {
+            return NULL;
+        }
+        grow_installed = TRUE;
+    }
+
+    map = mmap(NULL, size + page, PROT_NONE,
+               MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    if (mprotect(map + page + size - initial, initial,
+                 PROT_READ | PROT_WRITE) < 0) {
+        munmap(map, size + page);
+        return NULL;
+    }
+    *mapped = initial;
+    return (unsigned long *)(map + page);
+}
+
+// Frees a thread's stack: growable ones are unmapped, others pooled
+static void stack_free(thread t) {
+    if (t->stack_mapped != 0) {
+        munmap((char *)t->stack - get_page_size(),
+               t->stacksize + get_page_size());
+    } else {
+        stack_release(t->stack, t->stacksize);
+    }
+}
+
+
+// Stack measurement (lwp_set_stack_policy()): the top of a new stack,
+// up to LWP_STACK_MARK of it, is filled with STACK_CANARY, and the lowest
+// word that no longer holds it is as deep as the thread has been (a
+// growable stack has it carried down as it grows). When a thread is
+// reaped, that goes into its entry function's profile, which
+// LWP_STACK_ADAPT sizes that function's later stacks from. Profiles live
+// in a small open-addressed table keyed by function, under the library
+// lock; once it's full, new functions just aren't profiled.
+#define STACK_PROFILES 256  // power of two
+
+typedef struct stack_profile {
+    lwpfun        function;  // NULL: free slot
+    unsigned long threads;
+    size_t        peak;
+    int           overflowed;
+} stack_profile;
+
+static int stack_policy = 0;
+static stack_profile profiles[STACK_PROFILES];
+
+// Finds function's profile, adding one if add is set. NULL if there's
+// none (or no room). Called with the lock held.
+static stack_profile *profile_find(lwpfun function, int add) {
+    size_t i = ((unsigned long)function >> 4) & (STACK_PROFILES - 1);
+    size_t n;
+
+    for (n = 0; n < STACK_PROFILES; n++, i = (i + 1) & (STACK_PROFILES - 1)) {
+        if (profiles[i].function == function) {
+            return &profiles[i];
+        }
+        if (profiles[i].function == NULL) {
+            if (!add) {
+                return NULL;
+            }
+            profiles[i].function = function;
+            return &profiles[i];
+        }
+    }
+    return NULL;
+}
+
+// The stack size LWP_STACK_ADAPT would give function's threads now
+static size_t profile_size(const stack_profile *p) {
+    size_t size;
+
+    if (p == NULL || p->threads < LWP_STACK_ADAPT_MIN || p->overflowed) {
+        return default_stack_size;
+    }
+    size = round_stack_size(p->peak * 2);
+    return size < default_stack_size ? size : default_stack_size;
+}
+
+// The size of a default stack for a new thread running function (NULL:
+// the default, adapted or not). Called with the lock held.
+static size_t stack_size_for(lwpfun function) {
+    if (default_stack_size == 0) {
+        default_stack_size = round_stack_size(get_stack_size());
+    }
+    if (function == NULL || !(stack_policy & LWP_STACK_ADAPT)) {
+        return default_stack_size;
+    }
+    return profile_size(profile_find(function, FALSE));
+}
+
+// Gives t a default stack for running function. Under LWP_STACK_ADAPT,
+// one smaller than the default is growable, capped at the default, so
+// a thread deeper than its profile said grows instead of overflowing.
+// Returns FALSE if there's no memory. Called with the lock held.
+static int stack_alloc_for(thread t, lwpfun function) {
+    size_t size = stack_size_for(NULL), adapted = stack_size_for(function);
+
+    if (adapted < size) {
+        t->stack = grow_alloc(size, adapted, &t->stack_mapped);
+    } else {
+        t->stack = stack_alloc(size);
+    }
+    t->stacksize = size;
+    return t->stack != NULL;
+}
+
+// Fills the top of t's fresh stack with the canary, if we're measuring.
+// ctx_prepare() writes its frame over the very top afterwards.
+static void stack_mark(thread t) {
+    unsigned long *top = t->stack + t->stacksize / sizeof(unsigned long);
+    size_t span = t->stacksize < LWP_STACK_MARK ? t->stacksize : LWP_STACK_MARK;
+    unsigned long *p;
+
+    if (t->stack_mapped != 0 && span > t->stack_mapped) {
+        span = t->stack_mapped;  // don't grow it just for that
+    }
+
+    t->stack_marked = 0;
+    if (!(stack_policy & (LWP_STACK_MEASURE | LWP_STACK_ADAPT))) {
+        return;
+    }
+    for (p = top - span / sizeof(unsigned long); p < top; p++) {
+        *p = STACK_CANARY;
+    }
+    t->stack_marked = span;
+}
+
+// How deep t's stack has been used, going by its canary. All of the
+// marked span if none of the canary is left.
+static size_t stack_mark_depth(thread t) {
+    unsigned long *top = t->stack + t->stacksize / sizeof(unsigned long);
+    unsigned long *p = top - t->stack_marked / sizeof(unsigned long);
+
+    while (p < top && *p == STACK_CANARY) {
+        p++;
+    }
+    return (char *)top - (char *)p;
+}
+
+// Adds a reaped thread's high-water mark to its function's profile.
+// Called with the lock held.
+static void profile_note(thread t) {
+    size_t depth = stack_mark_depth(t);
+    stack_profile *p = profile_find(t->entry, TRUE);
+
+    if (p == NULL) {
+        return;
+    }
+    if (depth >= t->stack_marked && t->stack_marked < t->stacksize) {
+        p->overflowed = TRUE;  // it could have gone anywhere below
+    }
+    p->threads++;
+    if (depth > p->peak) {
+        p->peak = depth;
+    }
+}
+
+// Sets the stack policy: LWP_STACK_MEASURE, LWP_STACK_ADAPT (which
+// measures too), or 0 for neither. Threads that already exist keep
+// what they had.
+void lwp_set_stack_policy(int policy) {
+    stack_policy = policy & (LWP_STACK_MEASURE | LWP_STACK_ADAPT);
+}
+
+// Fills in up to max entry-function profiles, and returns how many
+// it filled in
+int lwp_stack_profiles(lwp_stackprofile *out, int max) {
+    int filled = 0, i;
+
+    LIB_LOCK();
+    if (default_stack_size == 0) {
+        default_stack_size = round_stack_size(get_stack_size());
+    }
+    for (i = 0; i < STACK_PROFILES && filled < max; i++) {
+        if (profiles[i].function != NULL) {
+            out[filled].function = profiles[i].function;
+            out[filled].threads = profiles[i].threads;
+            out[filled].peak = profiles[i].peak;
+            out[filled].overflowed = profiles[i].overflowed;
+            out[filled].size = profile_size(&profiles[i]);
+            filled++;
+        }
+    }
+    LIB_UNLOCK();
+    return filled;
+}
+
+
+// Context slab: threadinfo_st objects are carved out of large aligned
+// chunks instead of being malloc()ed one at a time. Each slot is padded
+// to a whole number of cache lines and starts on a cache line, which
+// also gives the embedded fxsave area the 16-byte alignment it needs.
+// Freed slots go on a free list (linked through the slot itself) and
+// are never returned to malloc.
+#define CACHE_LINE   64
+#define SLAB_SLOTS   64  // contexts per chunk
+#define SLOT_SIZE    ((sizeof(context) + CACHE_LINE - 1) & ~(CACHE_LINE - 1))
+
+typedef union free_slot {
+    union free_slot *next;
+    char pad[SLOT_SIZE];
+} free_slot;
+
+static free_slot *slab_free = NULL;
+
+// Gets a zeroed context from the slab, growing it by a chunk if needed
+static thread ctx_alloc(void) {
+    free_slot *slot;
+    int i;
+
+    if (slab_free == NULL) {
+        void *chunk;
+        if (posix_memalign(&chunk, CACHE_LINE, SLAB_SLOTS * SLOT_SIZE) != 0) {
+            return NULL;
+        }
+        slot = chunk;
+        for (i = 0; i < SLAB_SLOTS; i++) {
+            slot[i].next = slab_free;
+            slab_free = &slot[i];
+        }
+    }
+
+    slot = slab_free;
+    slab_free = slot->next;
+    memset(slot, 0, SLOT_SIZE);
+    return (thread) slot;
+}
+
+// Returns a context to the slab
+static void ctx_free(thread t) {
+    free_slot *slot = (free_slot *) t;
+    slot->next = slab_free;
+    slab_free = slot;
+}
+
+
+// Thread table: tid -> context for every thread that has been created
+// and not yet reaped (running, runnable, blocked, or zombie). Open
+// addressing with linear probing; since tids are handed out in order,
+// tid & mask spreads them perfectly. Deletion shifts later entries of
+// the same run back, so there are no tombstones.
+#define TID_TABLE_MIN 64
+
+static thread *tid_table = NULL;
+static size_t tid_mask = 0;    // capacity - 1
+static size_t tid_count = 0;
+
+// Places t in table without checking the load factor
+static void tid_place(thread *table, size_t mask, thread t) {
+    size_t i = t->tid & mask;
+    while (table[i] != NULL) {
+        i = (i + 1) & mask;
+    }
+    table[i] = t;
+}
+
+// Adds t to the table, growing it to keep the load under one half
+static int tid_insert(thread t) {
+    if ((tid_count + 1) * 2 > tid_mask + 1) {
+        size_t cap = tid_table ? (tid_mask + 1) * 2 : TID_TABLE_MIN;
+        thread *table = calloc(cap, sizeof(thread));
+        size_t i;
+        if (table == NULL) {
+            return FALSE;
+        }
+        for (i = 0; tid_table != NULL && i <= tid_mask; i++) {
+            if (tid_table[i] != NULL) {
+                tid_place(table, cap - 1, tid_table[i]);
+            }
+        }
+        free(tid_table);
+        tid_table = table;
+        tid_mask = cap - 1;
+    }
+    tid_place(tid_table, tid_mask, t);
+    tid_count++;
+    return TRUE;
+}
+
+// Drops tid from the table
+static void tid_remove(tid_t tid) {
+    size_t i, j;
+
+    if (tid_table == NULL) {
+        return;
+    }
+    for (i = tid & tid_mask; tid_table[i] != NULL; i = (i + 1) & tid_mask) {
+        if (tid_table[i]->tid == tid) {
+            break;
+        }
+    }
+    if (tid_table[i] == NULL) {
+        return;
+    }
+
+    // Backward-shift: pull up any later entry whose home slot is at or
+    // before the hole, so lookups never stop short at it
+    tid_table[i] = NULL;
+    tid_count--;
+    for (j = (i + 1) & tid_mask; tid_table[j] != NULL;
+         j = (j + 1) & tid_mask) {
+        size_t home = tid_table[j]->tid & tid_mask;
+        if (((j - home) & tid_mask) >= ((j - i) & tid_mask)) {
+            tid_table[i] = tid_table[j];
+            tid_table[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+
+static void finish_switch(void);
+static void lwp_switch(worker *w, thread old, thread new);
+
+void lwp_wrapper(lwpfun function, void *argument) {
+    /* Call the given lwpfunction with the given argument.
+        Calls lwp exit() with its return value
+    */
+    int rval;
+    finish_switch();  // we got here through a switch, not a return
+    preempt_on();     // new threads start masked, see ctx_prepare()
+    rval=function(argument);
+    lwp_exit(rval);
+}
+
+
+// Fills in a fresh context so that switching to it calls
+// function(argument) through lwp_wrapper on its own stack
+static void ctx_prepare(thread t, lwpfun function, void *argument) {
+    // Build the frame swap_rfiles() expects to "leave; ret" through:
+    // a saved rbp, then lwp_wrapper as the return address. The extra
+    // word on top keeps rsp 16-byte aligned (+8) on entry to the wrapper.
+    unsigned long *stack_top = (unsigned long *)(
+        t->stack + t->stacksize / sizeof(unsigned long)
+    );
+    stack_top--;
+    *stack_top = 0;                            // Alignment padding
+    stack_top--;
+    *stack_top = (unsigned long) lwp_wrapper;  // Fake return address
+    stack_top--;
+    *stack_top = 0;                            // Fake saved rbp
+
+    // Setup registers
+    t->state.rsp = (unsigned long) stack_top;
+    t->state.rbp = (unsigned long) stack_top;
+    t->state.rdi = (unsigned long) function;  // First argument
+    t->state.rsi = (unsigned long) argument;  // Second argument
+    t->state.fxsave = FPU_INIT;
+    if (stats_timing) {
+        t->stamp = __builtin_ia32_rdtsc();  // runnable from now
+    }
+
+    // The first switch into a thread lands in lwp_wrapper with the
+    // switching thread's preemption mask still in effect
+    t->preempt_off = 1;
+}
+
+
+// Records the run queue's length if it's the longest yet, for
+// lwp_stats()
+static void note_qlen(worker *w) {
+    int n = current_sched->qlen != NULL ? current_sched->qlen() : 0;
+    if (n > w->runq_peak) {
+        w->runq_peak = n;
+    }
+}
+
+
+// Inbox: the one way to make a thread runnable from a kernel thread
+// other than the one that owns its run queue, whether that's another
+// worker, a plain pthread, or a signal handler. Pushing is a single CAS
+// onto a Treiber stack, so it takes no locks and is async-signal-safe;
+// the owner takes the whole stack at once with an exchange (so there's
+// no ABA to worry about) and reverses it to admit in arrival order.
+static long futex(int *addr, int op, int val, const struct timespec *timeout) {
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+// Hands w a chain of threads linked through wake_next, newest first
+// (so top is the last to arrive and bottom the first), and wakes w if
+// it's idle
+static void inbox_push_chain(worker *w, thread top, thread bottom) {
+    thread old = __atomic_load_n(&w->inbox, __ATOMIC_RELAXED);
+    do {
+        bottom->wake_next = old;
+    } while (!__atomic_compare_exchange_n(&w->inbox, &old, top, TRUE,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&w->wake_seq, 1, __ATOMIC_SEQ_CST);
+    switch (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST)) {
+    case SLEEP_FUTEX:
+        futex(&w->wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL);
+        break;
+    case SLEEP_REACTOR:
+        io_wake();
+        break;
+    case SLEEP_HOOK: {
+        void (*wake)(void) = idle_policy.wake;
+        if (wake != NULL) {
+            wake();
+        }
+        break;
+    }
+    }
+}
+
+// Hands t to w's inbox and wakes w if it's idle
+static void inbox_push(worker *w, thread t) {
+    inbox_push_chain(w, t, t);
+}
+
+
+// Admits everything that's been handed to us
+static void drain_inbox(worker *w) {
+    thread t, fifo = NULL;
+    int n = 0;
+
+    if (__atomic_load_n(&w->inbox, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    t = __atomic_exchange_n(&w->inbox, NULL, __ATOMIC_ACQUIRE);
+    while (t != NULL) {  // newest first, so each goes in at the front
+        thread next = t->wake_next;
+        t->wake_next = NULL;
+        ring_add(&fifo, t);
+        fifo = t;
+        n++;
+        t = next;
+    }
+    sched_admit_batch(current_sched, fifo, n);
+    note_qlen(w);
+}
+
+
+// Sleeps until something lands in w's inbox (or, with a timeout, until
+// it expires). Only w's own kernel thread may call this.
+static void inbox_wait(worker *w, const struct timespec *timeout) {
+    int seq;
+
+    __atomic_store_n(&w->sleeping, SLEEP_FUTEX, __ATOMIC_SEQ_CST);
+    seq = __atomic_load_n(&w->wake_seq, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->inbox, __ATOMIC_SEQ_CST) == NULL) {
+        futex(&w->wake_seq, FUTEX_WAIT_PRIVATE, seq, timeout);
+    }
+    __atomic_store_n(&w->sleeping, FALSE, __ATOMIC_RELAXED);
+}
+
+
+// Like inbox_wait(), but blocks in an event source, the I/O reactor or
+// the idle policy's poll() (how says which), for at most max_ms (no
+// limit if negative), so that its events can wake us as well. Only one
+// worker at a time waits in each; returns FALSE at once if another is.
+static int reactor_busy = FALSE;
+static int hook_busy = FALSE;
+
+static int source_wait(worker *w, int how, int (*poll)(int), int max_ms) {
+    int *busy = how == SLEEP_REACTOR ? &reactor_busy : &hook_busy;
+    int expected = FALSE;
+
+    if (!__atomic_compare_exchange_n(busy, &expected, TRUE, FALSE,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return FALSE;
+    }
+    __atomic_store_n(&w->sleeping, how, __ATOMIC_SEQ_CST);
+    poll(__atomic_load_n(&w->inbox, __ATOMIC_SEQ_CST) == NULL ? max_ms : 0);
+    __atomic_store_n(&w->sleeping, FALSE, __ATOMIC_RELAXED);
+    __atomic_store_n(busy, FALSE, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+
+// Watches w's inbox for up to spin_ns before we go to the trouble of
+// sleeping. Returns TRUE if something arrived. Whoever is going to hand
+// us work needs a CPU to do it on, so without one to spare this would
+// only delay them; then we don't spin at all.
+static int idle_spin(worker *w, unsigned long spin_ns) {
+    static int ncpus = 0;
+    struct timespec start, now;
+    int i;
+
+    if (ncpus == 0) {
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (spin_ns == 0 || ncpus < 2 || nworkers > ncpus) {
+        return FALSE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        for (i = 0; i < 64; i++) {
+            if (__atomic_load_n(&w->inbox, __ATOMIC_RELAXED) != NULL) {
+                return TRUE;
+            }
+            __builtin_ia32_pause();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000000000UL +
+            now.tv_nsec - start.tv_nsec >= spin_ns) {
+            return FALSE;
+        }
+    }
+}
+
+
+// Waits, as the idle policy says, until w might have something to run.
+// It can return with nothing to run, and the caller just looks again.
+// steal: there may be work elsewhere that only looking will find, so
+// don't sleep longer than latency_us. spin: we've just run out of work,
+// rather than woken up to find none, so spin first.
+static void idle_wait(worker *w, int steal, int spin) {
+    lwp_idle p = idle_policy;
+    int io = io_pending();
+    int max_ms = -1;
+
+    if (spin && idle_spin(w, p.spin_ns)) {
+        return;
+    }
+
+    // Only one source can be blocked in at a time, so with both of them
+    // to watch, block in the reactor and look at poll() in between
+    if (steal || (io && p.poll != NULL)) {
+        max_ms = p.latency_us ? (int)((p.latency_us + 999) / 1000) : -1;
+    }
+    if (io && p.poll != NULL && p.poll(0) > 0) {
+        return;
+    }
+    if (io && source_wait(w, SLEEP_REACTOR, io_poll, max_ms)) {
+        return;
+    }
+    if (!io && p.poll != NULL && source_wait(w, SLEEP_HOOK, p.poll, max_ms)) {
+        return;
+    }
+    if (max_ms < 0) {
+        inbox_wait(w, NULL);
+    } else {
+        struct timespec ts = { p.latency_us / 1000000,
+                               (p.latency_us % 1000000) * 1000 };
+        inbox_wait(w, &ts);
+    }
+}
+
+
+// Makes a thread runnable. Run queues belong to their worker, so a
+// thread that lives elsewhere goes through that worker's inbox.
+static void lwp_ready(thread t) {
+    worker *w = cur_worker();
+    if (w == &outside_worker) {
+        inbox_push(worker_of(t), t);
+    } else if (!multicore || t->home == w->id) {
+        current_sched->admit(t);
+        note_qlen(w);
+    } else {
+        inbox_push(worker_of(t), t);
+    }
+}
+
+
+// Takes the calling thread off the run queue because it's about to
+// block. A thread that came from runnext was never admitted, so there's
+// nothing to remove; just make sure lwp_yield() doesn't admit it.
+static void sched_unqueue(thread self) {
+    worker *w = cur_worker();
+    if (w->direct == self) {
+        w->direct = NULL;
+    } else {
+        current_sched->remove(self);
+    }
+}
+
+
+// Creates a new lightweight process
+// Returns the thread ID or NO_THREAD if creation fails
+tid_t lwp_create(lwpfun function, void *argument) {
+    /*
+       Creates a new thread and admits it to the current scheduler. The
+       thread’s resources will consist of a context and stack, both
+       initialized so that when the scheduler chooses this thread and its
+       context is loaded via swap rfiles) it will run the given function. This
+       may be called by any thread.
+    */
+    return lwp_create_flags(function, argument, 0);
+}
+
+
+// Like lwp_create(), but with per-thread flags (see LWP_NOFPU in lwp.h)
+tid_t lwp_create_flags(lwpfun function, void *argument, unsigned int flags) {
+    lwp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.flags = flags;
+    return lwp_create_ex(function, argument, &attr);
+}
+
+
+// Like lwp_create(), but with explicit attributes. A NULL attr or a
+// stacksize of 0 means the RLIMIT_STACK default; other sizes are rounded
+// up to whole pages (and at least LWP_MIN_STACK).
+tid_t lwp_create_ex(lwpfun function, void *argument, const lwp_attr *attr) {
+    unsigned int flags = attr != NULL ? attr->flags : 0;
+    thread new_thread;
+    size_t stack_size;
+
+    if (!function) {
+        return NO_THREAD;
+    }
+
+    LIB_LOCK();
+    new_thread = ctx_alloc();
+    if (!new_thread) {
+        LIB_UNLOCK();
+        return NO_THREAD;
+    }
+    
+    // Allocate stack
+    if (attr != NULL && attr->stacksize != 0) {
+        stack_size = round_stack_size(attr->stacksize);
+    } else {
+        stack_size = stack_size_for(NULL);  // what adapted stacks grow to
+    }
+    if (flags & LWP_GROWABLE) {
+        new_thread->stack = grow_alloc(stack_size, LWP_GROW_INITIAL,
+                                       &new_thread->stack_mapped);
+        new_thread->stacksize = stack_size;
+    } else if (attr != NULL && attr->stacksize != 0) {
+        new_thread->stack = stack_alloc(stack_size);
+        new_thread->stacksize = stack_size;
+    } else {
+        stack_alloc_for(new_thread, function);
+    }
+    if (new_thread->stack == NULL) {
+        ctx_free(new_thread);
+        LIB_UNLOCK();
+        return NO_THREAD;
+    }
+
+    // Assign thread ID
+    new_thread->tid = next_tid++;
+    new_thread->status = LWP_LIVE;
+    new_thread->flags = flags;
+    new_thread->prio = attr != NULL ? attr->prio : 0;
+    if (new_thread->prio < 0) new_thread->prio = 0;
+    if (new_thread->prio >= LWP_PRIO_LEVELS) {
+        new_thread->prio = LWP_PRIO_LEVELS - 1;  // as lwp_set_priority()
+    }
+    new_thread->tickets = attr != NULL ? attr->tickets : 0;
+    new_thread->entry = function;
+    if (!tid_insert(new_thread)) {
+        stack_free(new_thread);
+        ctx_free(new_thread);
+        LIB_UNLOCK();
+        return NO_THREAD;
+    }
+    live_count++;
+    spawn_count++;
+
+    // Spread new threads over the workers
+    new_thread->home = multicore ? next_placement++ % nworkers : 0;
+    LIB_UNLOCK();
+
+    // Final cleanup in the wrapper will handle calling the function & exiting
+    stack_mark(new_thread);
+    ctx_prepare(new_thread, function, argument);
+    TRACE(TRACE_CREATE, new_thread->tid, cur_worker()->id);
+
+    // Admit the new thread to the scheduler
+    preempt_off();
+    lwp_ready(new_thread);
+    preempt_on();
+    return new_thread->tid;
+}
+
+
+// lwp_create_many() sets up and admits threads this many at a time, so
+// none of its buffers need allocating. It's also how many stacks share
+// a mapping.
+#define CREATE_BATCH 64
+
+// Creates n threads running function(args[i]) (args may be NULL for
+// all-NULL arguments) with default attributes, storing their tids in
+// tids if it isn't NULL. The library lock is taken once per
+// CREATE_BATCH threads, their stacks come from one mapping, and threads
+// bound for another worker go to its inbox in one push. That makes it
+// cheaper than n lwp_create()s when the stacks come from the pool, but
+// not by much when they have to be mapped (see stack_alloc_many()), and
+// not at all for adapted stacks, which are growable and mapped one by one.
+// Returns how many were created, which is fewer than n only if memory
+// ran out.
+int lwp_create_many(lwpfun function, void *args[], int n, tid_t tids[]) {
+    unsigned long *stacks[CREATE_BATCH];
+    thread batch[CREATE_BATCH];
+    size_t size;
+    worker *w;
+    int created = 0, adapted, k, i, j;
+
+    if (!function) {
+        return 0;
+    }
+
+    while (created < n) {
+        k = n - created < CREATE_BATCH ? n - created : CREATE_BATCH;
+
+        LIB_LOCK();
+        size = stack_size_for(NULL);
+        adapted = stack_size_for(function) < size;
+        if (!adapted) {
+            k = stack_alloc_many(size, stacks, k);
+        }
+        for (i = 0; i < k; i++) {
+            thread t = ctx_alloc();
+            if (t == NULL) {
+                break;
+            }
+            if (adapted) {  // growable, one at a time
+                if (!stack_alloc_for(t, function)) {
+                    ctx_free(t);
+                    break;
+                }
+            } else {
+                t->stack = stacks[i];
+                t->stacksize = size;
+            }
+            t->tid = next_tid++;
+            t->status = LWP_LIVE;
+            t->entry = function;
+            if (!tid_insert(t)) {
+                if (adapted) {
+                    stack_free(t);
+                }
+                ctx_free(t);
+                break;
+            }
+            t->home = multicore ? next_placement++ % nworkers : 0;
+            batch[i] = t;
+        }
+        for (j = i; j < k && !adapted; j++) {  // ran out part way
+            stack_release(stacks[j], size);
+        }
+        k = i;
+        live_count += k;
+        spawn_count += k;
+        LIB_UNLOCK();
+
+        for (i = 0; i < k; i++) {
+            stack_mark(batch[i]);
+            ctx_prepare(batch[i], function, args ? args[created + i] : NULL);
+            TRACE(TRACE_CREATE, batch[i]->tid, cur_worker()->id);
+            if (tids != NULL) {
+                tids[created + i] = batch[i]->tid;
+            }
+        }
+
+        // Admit ours in one go, and chain up everyone else's (newest
+        // first, as the inbox wants) to push in one go per worker
+        preempt_off();
+        w = cur_worker();
+        for (j = 0; j < (multicore ? nworkers : 1); j++) {
+            thread top = NULL, bottom = NULL, ours = NULL;
+            int nours = 0;
+            for (i = 0; i < k; i++) {
+                if (batch[i]->home != j) {
+                    continue;
+                }
+                if (!multicore || j == w->id) {
+                    ring_add(&ours, batch[i]);
+                    nours++;
+                } else {
+                    batch[i]->wake_next = top;
+                    top = batch[i];
+                    if (bottom == NULL) bottom = top;
+                }
+            }
+            if (ours != NULL) {
+                sched_admit_batch(current_sched, ours, nours);
+                note_qlen(w);
+            }
+            if (top != NULL) {
+                inbox_push_chain(workers[j], top, bottom);
+            }
+        }
+        preempt_on();
+
+        created += k;
+        if (k < CREATE_BATCH && created < n) {
+            break;  // out of memory
+        }
+    }
+    return created;
+}
+
 
-int queue_empty(thread_queue *queue) {
-    return (queue == NULL || queue->size == 0);
+// Sets how many kernel threads lwp_start() runs LWPs on (default 1)
+void lwp_set_workers(int n) {
+    if (!multicore && n >= 1) {
+        nworkers = n;
+    }
 }
 
-// Initialize the waiting queue
-thread_queue waiting_queue = {NULL, 0, 0, MAX_QUEUE_SIZE, 0};
 
-typedef struct thread_node {
-    thread t;
-    struct thread_node *next, *prev;
-} thread_node;
+// Returns the number of workers
+int lwp_get_workers(void) {
+    return nworkers;
+}
 
-static thread_node *head = NULL; // Circular queue head
-static int queue_length = 0;
 
-// Round Robin Scheduler Functions
-void rr_admit(thread new) {
-    thread_node *node = malloc(sizeof(thread_node));
-    if (!node) return;
-    node->t = new;
-    
-    if (!head) {  // First thread
-        node->next = node->prev = node;
-        head = node;
-    } else {  // Insert at end
-        thread_node *tail = head->prev;
-        tail->next = node;
-        node->prev = tail;
-        node->next = head;
-        head->prev = node;
-    }
-    queue_length++;
+// Returns the calling worker's index, 0 through lwp_get_workers()-1, or
+// -1 on a kernel thread that isn't one of them
+int lwp_worker_id(void) {
+    return cur_worker()->id;
 }
 
 
-void rr_remove(thread victim) {
-    if (!head) return;
+// Preemption: each worker has a timer on its own CPU clock that sends
+// it SIGVTALRM every preempt_quantum microseconds of running. The
+// handler yields on behalf of whatever thread it interrupted, unless
+// that thread is inside the library, in which case the yield happens
+// when it leaves. The kernel has already saved every register (FPU
+// included) in the signal frame on the interrupted thread's stack, so
+// an ordinary switch from inside the handler is enough.
+//
+// That frame can be bigger than the slack a growable stack keeps mapped
+// below its deepest point (it holds the whole AVX-512 state on some
+// machines), and if it runs into the unmapped part the kernel kills the
+// process instead of raising a SIGSEGV grow_handler() could act on. It
+// can't go on the sigaltstack instead, since then a switch from the
+// handler would leave the thread's frames there for the next tick to
+// overwrite. So the timer is stopped while a growable thread runs:
+// lwp_switch() stops it before switching to one, and finish_switch()
+// starts it again once a thread that isn't growable is current.
+static unsigned long preempt_quantum = 0;  // usec, 0 = cooperative only
+static int preempt_installed = FALSE;
+
+static void preempt_handler(int sig) {
+    worker *w = cur_worker();
+    thread t = w->current;
+    int saved_errno = errno;
+
+    if (t == NULL || t->preempt_off) {
+        w->preempt_pending = TRUE;
+        return;
+    }
+    reschedule();
+    errno = saved_errno;
+}
 
-    thread_node *current = head;
-    do {
-        if (current->t == victim) {
-            if (current == head && current->next == head) {
-                head = NULL;  // Only one thread in the queue
-            } else {
-                current->prev->next = current->next;
-                current->next->prev = current->prev;
-                if (head == current) head = current->next;
-            }
-            free(current);
-            queue_length--;
+// (Re)arms the calling worker's timer with a quantum of usec, or stops
+// it for 0
+static void preempt_arm(worker *w, unsigned long usec) {
+    struct itimerspec its;
+
+    if (usec != 0 && !preempt_installed) {
+        struct sigaction sa;
+        sa.sa_handler = preempt_handler;
+        sigemptyset(&sa.sa_mask);
+        // SA_NODEFER: the handler switches threads, and whatever runs
+        // next must still be preemptible
+        sa.sa_flags = SA_RESTART | SA_NODEFER;
+        if (sigaction(SIGVTALRM, &sa, NULL) < 0) {
+            perror("sigaction");
+            return;
+        }
+        preempt_installed = TRUE;
+    }
+    if (!w->has_timer && usec != 0) {
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGVTALRM;
+        sev.sigev_notify_thread_id = syscall(SYS_gettid);
+        if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &w->timer) < 0) {
+            perror("timer_create");
             return;
         }
-        current = current->next;
-    } while (current != head);
+        w->has_timer = TRUE;
+    }
+    if (w->has_timer) {
+        its.it_value.tv_sec = usec / 1000000;
+        its.it_value.tv_nsec = (usec % 1000000) * 1000;
+        its.it_interval = its.it_value;
+        timer_settime(w->timer, 0, &its, NULL);
+    }
+    w->quantum = usec;
 }
 
-
-thread rr_next(void) {
-    if (!head) return NULL;
-    head = head->next; // Move to the next thread in the queue
-    return head->t;
+// Arms the calling worker's timer for t running: with the quantum,
+// unless t's stack is growable
+static void preempt_sync(worker *w, thread t) {
+    unsigned long usec =
+        t != NULL && t->stack_mapped != 0 ? 0 : preempt_quantum;
+    if (w->quantum != usec) {
+        preempt_arm(w, usec);
+    }
 }
 
 
-int rr_qlen(void) {
-    return queue_length;
+// Sets the preemption quantum in microseconds; 0 turns preemption off.
+// Each worker picks up a change the next time it schedules.
+void lwp_set_preemption(unsigned long usec) {
+    preempt_quantum = usec;
+    if (current_thread != NULL) {
+        preempt_sync(cur_worker(), current_thread);
+    }
 }
 
 
-struct scheduler rr_publish = {
-    NULL, NULL, rr_admit, rr_remove, rr_next, rr_qlen
-};
-scheduler RoundRobin = &rr_publish;
-
+// Sets what workers do when they run out of threads (see lwp_idle in
+// lwp.h). NULL restores the defaults. Returns -1 if poll() is given
+// without wake().
+int lwp_set_idle(const lwp_idle *policy) {
+    static const lwp_idle defaults = {
+        LWP_IDLE_SPIN_NS, LWP_IDLE_LATENCY_US, NULL, NULL
+    };
 
-// Add a thread to the waiting queue
-void enqueue(thread t) {
-    if (waiting_queue.size < waiting_queue.capacity) {
-        waiting_queue.threads[waiting_queue.rear] = t;
-        waiting_queue.rear = (waiting_queue.rear + 1) % waiting_queue.capacity;
-        waiting_queue.size++;
+    if (policy == NULL) {
+        policy = &defaults;
+    }
+    if (policy->poll != NULL && policy->wake == NULL) {
+        return -1;
     }
+    idle_policy = *policy;
+    return 0;
 }
 
-// Remove a thread from the front of the waiting queue
-thread dequeue(void) {
-    if (waiting_queue.size > 0) {
-        thread t = waiting_queue.threads[waiting_queue.front];
-        waiting_queue.front = (waiting_queue.front + 1)%waiting_queue.capacity;
-        waiting_queue.size--;
-        return t;
-    }
-    return NULL;  // If the queue is empty
+
+void lwp_get_idle(lwp_idle *policy) {
+    *policy = idle_policy;
 }
 
-// Check if the queue is empty
-int is_empty(void) {
-    return waiting_queue.size == 0;
+
+// Masks preemption of the calling thread until the matching
+// lwp_preempt_enable(). Nests.
+void lwp_preempt_disable(void) {
+    preempt_off();
 }
 
-size_t get_stack_size() {
-    struct rlimit limit;
-    if (getrlimit(RLIMIT_STACK, &limit) == 0) {
-        return limit.rlim_cur;  // Soft limit
+
+void lwp_preempt_enable(void) {
+    preempt_on();
+}
+
+
+// A worker's scheduling loop, run by its idle context whenever none of
+// its threads are runnable
+static int worker_loop(void *unused) {
+    worker *w = cur_worker();
+    int busy = TRUE;
+    thread t;
+
+    for (;;) {
+        preempt_sync(w, w->idle);
+        drain_inbox(w);
+        t = current_sched->next();
+        if (t != NULL) {
+            lwp_switch(w, w->idle, t);
+            busy = TRUE;
+            continue;
+        }
+
+        // Wait until someone hands us something, looking around again
+        // every so often for schedulers that steal work
+        idle_wait(w, TRUE, busy);
+        busy = FALSE;
     }
-    return 8 * 1024;  // Fallback to 8KB if getrlimit fails
+    return 0;
 }
 
 
-void lwp_wrapper(lwpfun function, void *argument) {
-    /* Call the given lwpfunction with the given argument.
-        Calls lwp exit() with its return value
-    */
-    int rval;
-    rval=function(argument);
-    lwp_exit(rval);
+// Body of workers 1..n-1: the kernel thread's own stack is the idle context
+static void *worker_main(void *arg) {
+    worker *w = arg;
+    this_worker = w;
+    grow_altstack();
+    w->current = w->idle;
+    w->idle->oncpu = 1;
+    preempt_sync(w, w->idle);
+    worker_loop(NULL);
+    return NULL;
 }
 
 
-// Creates a new lightweight process
-// Returns the thread ID or NO_THREAD if creation fails
-tid_t lwp_create(lwpfun function, void *argument) {
-    /*
-       Creates a new thread and admits it to the current scheduler. The
-       thread’s resources will consist of a context and stack, both
-       initialized so that when the scheduler chooses this thread and its
-       context is loaded via swap rfiles) it will run the given function. This
-       may be called by any thread.
-    */
+// Sets up workers[] and starts the extra kernel threads. Threads created
+// before lwp_start() are all on the boot worker's run queue, so they are
+// dealt out round-robin first.
+static int start_workers(void) {
+    thread pending, t;
+    int i, n;
 
-    if (!function) {
-        return NO_THREAD;
+    workers = calloc(nworkers, sizeof(worker *));
+    if (workers == NULL) {
+        return FALSE;
     }
-    
-    thread new_thread = malloc(sizeof(struct threadinfo_st));
-    if (!new_thread) {
-        return NO_THREAD;
+    workers[0] = &boot_worker;
+    for (i = 0; i < nworkers; i++) {
+        worker *w = i == 0 ? &boot_worker : calloc(1, sizeof(worker));
+        thread idle = ctx_alloc();
+        if (w == NULL || idle == NULL) {
+            return FALSE;
+        }
+        w->id = i;
+        w->idle = idle;
+        idle->flags = LWP_NOFPU;
+        idle->preempt_off = 1;  // never preempt the scheduling loop
+        idle->home = i;
+        workers[i] = w;
     }
-    
-    // Allocate stack
-    size_t stack_size = get_stack_size();
-    new_thread->stack = mmap(
-        NULL,
-        stack_size,
-        PROT_READ | PROT_WRITE,
-        MAP_ANONYMOUS | MAP_PRIVATE,
-        -1,
-        0
-    );
-    if (new_thread->stack == MAP_FAILED) {
-        free(new_thread);
-        return NO_THREAD;
+
+    // The boot worker's idle loop needs a stack of its own, since the
+    // process stack belongs to the thread calling lwp_start()
+    boot_worker.idle->stacksize = round_stack_size(LWP_MIN_STACK);
+    boot_worker.idle->stack = stack_alloc(boot_worker.idle->stacksize);
+    if (boot_worker.idle->stack == NULL) {
+        return FALSE;
+    }
+    ctx_prepare(boot_worker.idle, worker_loop, NULL);
+    boot_worker.idle->preempt_off = 2;  // lwp_wrapper drops one
+
+    pending = sched_drain(current_sched, &n);
+    multicore = TRUE;
+    while (n-- > 0) {
+        t = pending;
+        pending = t->sched_one;
+        t->sched_one = t->sched_two = NULL;
+        t->home = next_placement++ % nworkers;
+        lwp_ready(t);
     }
 
-    // Assign thread ID
-    new_thread->tid = next_tid++;
+    for (i = 1; i < nworkers; i++) {
+        if (pthread_create(&workers[i]->pthread, NULL, worker_main,
+                           workers[i]) != 0) {
+            perror("pthread_create");
+            exit(3);
+        }
+    }
+    return TRUE;
+}
 
-    // Align stack pointer to 16-byte boundary
-    unsigned long *stack_top = (unsigned long *)(
-        new_thread->stack + stack_size / sizeof(unsigned long)
-    );
-    stack_top--;  // Space for return address
-    *stack_top = (unsigned long) lwp_wrapper;  // Fake return address
 
-    // Setup registers
-    new_thread->state.rsp = (unsigned long) stack_top;
-    new_thread->state.rdi = (unsigned long) function;  // First argument
-    new_thread->state.rsi = (unsigned long) argument;  // Second argument
-    new_thread->state.rbp = 0;  // Clear base pointer
+// Statistics: every switch is counted. With lwp_set_stats() on, it also
+// charges the TSC ticks since the last one to the outgoing thread's run
+// time, and those since the incoming thread was last switched out (or
+// woken, if it was parked) to its wait time. TSC ticks are converted to
+// nanoseconds by lwp_stats(), at the rate they've gone up by since
+// lwp_start().
+static unsigned long long tsc_base = 0;
+static struct timespec tsc_base_time;
+
+// Takes the TSC and clock readings lwp_stats() measures against, and
+// returns the TSC
+static unsigned long long tsc_calibrate(void) {
+    clock_gettime(CLOCK_MONOTONIC, &tsc_base_time);
+    tsc_base = __builtin_ia32_rdtsc();
+    return tsc_base;
+}
 
-    // Final cleanup in the wrapper will handle calling the function & exiting
-    // Admit the new thread to the scheduler
-    if (current_sched) {
-        current_sched->admit(new_thread);
-    }
-    return new_thread->tid;
+// Nanoseconds per TSC tick, or 0 if we can't tell yet
+static double tsc_scale(void) {
+    struct timespec now;
+    unsigned long long ticks;
+    double ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ticks = __builtin_ia32_rdtsc() - tsc_base;
+    ns = (now.tv_sec - tsc_base_time.tv_sec) * 1e9 +
+         (now.tv_nsec - tsc_base_time.tv_nsec);
+    return tsc_base == 0 || ticks == 0 ? 0 : ns / ticks;
 }
 
+
 // Starts the LWP system
 void lwp_start(void) {
     /*
@@ -205,66 +1724,237 @@ void lwp_start(void) {
         yield control to the scheduler to allow the system to run this thread
         as a part of the LWP system.
     */
+    thread current;
+
+    // Already started
+    if (current_thread != NULL || unbound != &boot_worker) {
+        return;
+    }
 
-    // Check if we're already in a valid state (if not, exit)
-    if (current_thread == NULL) {
+    // Create a context for the calling thread without allocating a new
+    // stack; its registers are filled in the first time it is switched out
+    current = ctx_alloc();
+    if (!current) {
         return;
     }
+    current->tid = next_tid++;
+    current->stack = NULL;  // Running on the process stack
+    current->stacksize = 0;
+    current->status = LWP_LIVE;
+    current->flags = 0;
+    current->oncpu = 1;
+    current->stamp = tsc_calibrate();
+    if (!tid_insert(current)) {
+        ctx_free(current);
+        return;
+    }
+    grow_altstack();
+
+    // This kernel thread is the boot worker from now on, and no other
+    // that isn't a worker may act as it
+    this_worker = &boot_worker;
+    outside_worker.id = -1;
+    unbound = &outside_worker;
+
+    // The worker count is final now; let the scheduler size anything
+    // it keeps per worker before they start calling it
+    if (current_sched->init) {
+        current_sched->init();
+    }
+    if (nworkers > 1 && !start_workers()) {
+        fprintf(stderr, "lwp_start: cannot start %d workers\n", nworkers);
+        exit(3);
+    }
 
-    // Create context for the calling thread without allocating a new stack
-    thread current = current_thread;
+    // Admit the thread to the scheduler
+    current_thread = current;
+    LIB_LOCK();
+    live_count++;
+    LIB_UNLOCK();
+    current_sched->admit(current);
+    note_qlen(&boot_worker);
+    preempt_sync(&boot_worker, current);
 
-    // Set up the context as if this thread had just been created
-    // The return address should go to lwp_exit() when the thread finishes
-    unsigned long *stack_top = (unsigned long *)(current->state.rsp);
+    // Yield control to the scheduler
+    reschedule();
+}
 
-    // Set up a fake return address
-    stack_top--;  // Space for return address
-    *stack_top = (unsigned long) lwp_exit;  // Fake return address
 
-    // Update the stack pointer in the context
-    current->state.rsp = (unsigned long)stack_top;
+// Does the accounting for a switch from old to new on w. old is still
+// running, on its own stack, so that's as deep as it is right now.
+static void switch_stats(worker *w, thread old, thread new) {
+    unsigned long long now;
 
-    // Set up the thread's registers
-    current->state.rdi = 0;  // No function argument
-    current->state.rsi = 0;  // No additional argument
+    new->nsched++;
+    w->switches++;
+    if (!stats_timing) {
+        return;
+    }
+    now = __builtin_ia32_rdtsc();
+    old->run_tsc += now - old->stamp;
+    __atomic_store_n(&old->stamp, now, __ATOMIC_RELAXED);
+    if (old->stack != NULL) {
+        size_t depth = (char *)old->stack + old->stacksize -
+                       (char *)__builtin_frame_address(0);
+        if (depth > old->stack_peak) {
+            old->stack_peak = depth;
+        }
+    }
+    new->wait_tsc += now - __atomic_load_n(&new->stamp, __ATOMIC_RELAXED);
+    new->stamp = now;
+}
 
-    // We don't deallocate the current stack, just mark it as valid
-    current->state.rbp = 0;  // Clear base pointer for simplicity
 
-    // Admit the thread to the scheduler
-    if (current_sched) {
-        current_sched->admit(current);
+// Switches from one thread to another. The integer-only path is taken
+// when neither side uses the FPU; otherwise the full fxsave/fxrstor
+// path is needed so the FPU-using side gets its state back.
+static void lwp_switch(worker *w, thread old, thread new) {
+    if (multicore) {
+        // Another worker may still be on its way out of new's stack
+        while (__atomic_load_n(&new->oncpu, __ATOMIC_ACQUIRE)) {
+            __builtin_ia32_pause();
+        }
+    }
+    new->oncpu = 1;
+    new->home = w->id;  // schedulers may migrate threads between workers
+    if (new->stack_mapped != 0 && w->quantum != 0) {
+        preempt_arm(w, 0);  // no ticks on its stack (see preempt_quantum)
     }
+    switch_stats(w, old, new);
+    TRACE(TRACE_STOP, old->tid, w->id);
+    TRACE(TRACE_RUN, new->tid, w->id);
+    w->preempt_pending = FALSE;
+    w->prev = old;
+    w->current = new;
+    if (old->flags & new->flags & LWP_NOFPU) {
+        swap_rfiles_nofp(&old->state, &new->state);
+    } else {
+        swap_rfiles(&old->state, &new->state);
+    }
+    finish_switch();
+}
 
-    // Yield control to the scheduler
-    lwp_yield();
+
+// Runs first thing in whatever context a switch lands in: the thread we
+// switched away from is now fully saved, so other workers may run it
+// (or reap it) from here on.
+static void finish_switch(void) {
+    worker *w = cur_worker();
+    if (w->prev != NULL) {
+        __atomic_store_n(&w->prev->oncpu, 0, __ATOMIC_RELEASE);
+        w->prev = NULL;
+    }
+    if (w->quantum != preempt_quantum) {
+        preempt_sync(w, w->current);  // restarts it after a growable one
+    }
 }
 
+#define HANDOFF_LIMIT 16
+#define REACTOR_INTERVAL 64  // yields between non-blocking polls
+
 // Yields control to another LWP
 void lwp_yield(void) {
     /*
        Yields control to another thread, saving the current thread's context,
        selecting the next thread from the scheduler, restoring its context,
-       and returning to it. If no next thread is available, the program exits.
+       and returning to it. If no next thread is available, the program exits
+       (or, with several workers, this one idles until it gets more work).
     */
+    thread self = current_thread;
+    if (self != NULL) {
+        self->nyields++;
+    }
+    reschedule();
+}
 
-    // Step 1: Save the current thread's context
-    if (current_thread != NULL) {
-        // Save the current thread's context (i.e., registers, stack pointer)
-        swap_rfiles(&current_thread->state, NULL);
+// lwp_yield() without counting it as one: for blocking, exiting, and
+// preemption
+static void reschedule(void) {
+    worker *w = cur_worker();
+
+    thread old_thread = w->current, next_thread = NULL;
+    int spin = TRUE;
+
+    if (w == &outside_worker) {
+        return;  // no LWP runs on this kernel thread
+    }
+    // Step 1: Pick the next thread from the scheduler
+    if (old_thread != NULL) {
+        old_thread->preempt_off++;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    }
+    w->preempt_pending = FALSE;  // we're doing what the tick asked for
+    preempt_sync(w, old_thread);
+    drain_inbox(w);
+    if ((io_pending() || idle_policy.poll != NULL) &&
+        ++w->yields % REACTOR_INTERVAL == 0) {
+        // So busy workers don't starve I/O or the idle policy's source
+        int (*poll)(int) = idle_policy.poll;
+        if (io_pending()) {
+            io_poll(0);
+        }
+        if (poll != NULL) {
+            poll(0);
+        }
+        drain_inbox(w);
     }
 
-    // Step 2: Pick the next thread from the scheduler
-    thread next_thread = current_sched->next();
+    // A thread run from runnext joins the run queue once it gives up the
+    // CPU. Handed-off threads go first, but only HANDOFF_LIMIT times in a
+    // row, so a pair passing work back and forth can't starve the rest.
+    if (w->direct != NULL) {
+        current_sched->admit(w->direct);
+        w->direct = NULL;
+    }
+    if (w->runnext != NULL) {
+        if (w->handoffs < HANDOFF_LIMIT) {
+            next_thread = w->runnext;
+            w->direct = next_thread;
+            w->handoffs++;
+        } else {
+            current_sched->admit(w->runnext);
+        }
+        w->runnext = NULL;
+    }
     if (next_thread == NULL) {
-        // No threads to run, so terminate the program
-        exit(3);
+        w->handoffs = 0;
+        next_thread = current_sched->next();
+    }
+    while (next_thread == NULL && !multicore) {
+        if (!io_pending() && idle_policy.poll == NULL &&
+            __atomic_load_n(&parked_count, __ATOMIC_SEQ_CST) == 0 &&
+            __atomic_load_n(&w->inbox, __ATOMIC_SEQ_CST) == NULL) {
+            // No threads to run, and nothing that could ever make one
+            // runnable again, so terminate the program
+            exit(3);
+        }
+        // Otherwise an fd, a timer, the idle policy's source, or
+        // lwp_unpark() from outside will give us work
+        idle_wait(w, FALSE, spin);
+        spin = FALSE;
+        drain_inbox(w);
+        next_thread = current_sched->next();
+    }
+    if (next_thread == NULL) {
+        next_thread = w->idle;
+    }
+
+    // Step 2: Save the current thread's context and restore the next one's.
+    // We come back here when something switches back to us.
+    if (next_thread != old_thread) {
+        if (old_thread != NULL) {
+            lwp_switch(w, old_thread, next_thread);
+        } else {
+            w->current = next_thread;
+            next_thread->oncpu = 1;
+            swap_rfiles(NULL, &next_thread->state);
+        }
     }
 
-    // Step 3: Restore the next thread's context
-    current_thread = next_thread;
-    swap_rfiles(NULL, &current_thread->state);
+    if (old_thread != NULL) {
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        old_thread->preempt_off--;
+    }
 }
 
 // Exits the current LWP
@@ -275,93 +1965,305 @@ void lwp_exit(int exitval) {
        will yield control to the next runnable thread. The thread's resources
        will be deallocated when it's waited for.
     */
-    
-    if (current_thread != NULL) {
-        // Set the thread's status to terminated, using MKTERMSTAT to combine
-        // the status and exit code
-        current_thread->status = MKTERMSTAT(LWP_TERM, exitval & 0xFF);
+    thread self = current_thread, waiter;
+    if (self == NULL) {
+        return;
+    }
 
-        // Step 1: Yield control to the next thread
-        lwp_yield();
+    // Set the thread's status to terminated, using MKTERMSTAT to combine
+    // the status and exit code, and take it off the run queue for good.
+    // It stays masked from here on; nothing is coming back to unmask it.
+    preempt_off();
+    self->status = MKTERMSTAT(LWP_TERM, exitval & 0xFF);
+    TRACE(TRACE_EXIT, self->tid, cur_worker()->id);
+    sched_unqueue(self);
+
+    // Hand ourselves straight to the oldest waiter if there is one,
+    // otherwise wait on the zombie list for someone to call lwp_wait()
+    LIB_LOCK();
+    live_count--;
+    if (multicore && live_count == 0) {
+        exit(3);  // the other workers have nothing left to run either
+    }
+    waiter = tq_pop(&waiters);
+    if (waiter != NULL) {
+        waiter_count--;
+    } else {
+        waiter = tq_pop(&timed_waiters);
+    }
+    if (waiter != NULL) {
+        // Unparked under the lock so it can't be reaped first
+        __atomic_store_n(&waiter->exited, self, __ATOMIC_RELEASE);
+        lwp_unpark(waiter);
+    } else {
+        self->exited = NULL;
+        if (zombie_tail) {
+            zombie_tail->exited = self;
+        } else {
+            zombie_head = self;
+        }
+        zombie_tail = self;
     }
+    LIB_UNLOCK();
+
+    // Never returns: nothing will ever schedule us again
+    reschedule();
 }
 
 
-// Handles waking up blocked threads when a thread exits
-void lwp_exit_blocked(thread_queue *waiting_queue) {
-    if (waiting_queue == NULL || queue_empty(waiting_queue)) {
-        return;  // No blocked threads to wake up
+// Frees an exited thread's resources and reports its status
+static tid_t reap(thread zombie, int *status) {
+    tid_t tid = zombie->tid;
+
+    if (status != NULL) {
+        *status = LWPTERMSTAT(zombie->status);
+    }
+
+    // Its worker may still be switching away from it, and whoever woke
+    // it last may still be in lwp_unpark()
+    while (__atomic_load_n(&zombie->oncpu, __ATOMIC_ACQUIRE) ||
+           __atomic_load_n(&zombie->pins, __ATOMIC_ACQUIRE)) {
+        __builtin_ia32_pause();
+    }
+
+    // The system thread runs on the process stack; there's nothing to free
+    LIB_LOCK();
+    if (zombie->stack != NULL) {
+        if (zombie->stack_marked) {
+            profile_note(zombie);
+        }
+        stack_free(zombie);
     }
+    tid_remove(tid);
+    ctx_free(zombie);
+    reap_count++;
+    LIB_UNLOCK();
+    return tid;
+}
 
-    // Dequeue the first blocked thread
-    thread unblocked_thread = dequeue();
-    if (unblocked_thread != NULL) {
-        current_sched->admit(unblocked_thread);  // Re-add it to the scheduler
+
+// Takes the oldest zombie, or returns NULL. Called with the lock held.
+static thread zombie_pop(void) {
+    thread zombie = zombie_head;
+    if (zombie != NULL) {
+        zombie_head = zombie->exited;
+        if (!zombie_head) zombie_tail = NULL;
     }
+    return zombie;
 }
 
 
 // Waits for a thread to terminate
 tid_t lwp_wait(int *status) {
-    // Check if there are terminated threads in the scheduler
-    if (current_sched->qlen() > 1) {
-        // Find the oldest terminated thread (FIFO order)
-        thread terminated_thread = NULL;
-          // Assuming next() gives the next thread in the scheduler
-        thread temp_thread = current_sched->next();
-
-        while (temp_thread != NULL) {
-            if (temp_thread->status == LWP_TERM) {
-                terminated_thread = temp_thread;
-                break;  // Get the oldest terminated thread (FIFO)
-            }
-            // Traverse through the scheduler's linked list of threads
-            temp_thread = temp_thread->sched_one;
-        }
+    /*
+       Reaps the oldest exited thread and returns its tid, filling in its
+       termination status (LWPTERMSTAT() of it, the value passed to
+       lwp_exit()) if status is non-NULL. If nothing has exited yet the
+       caller is parked until lwp_exit() hands it a thread. Returns
+       NO_THREAD if every other live thread is itself waiting, since then
+       nothing could ever exit.
+    */
+    thread self = current_thread;
+    thread zombie;
+
+    LIB_LOCK();
+    zombie = zombie_pop();
+    if (zombie != NULL) {
+        LIB_UNLOCK();
+        return reap(zombie, status);
+    }
 
-        if (terminated_thread != NULL) {
-            // If status is non-NULL, populate it with the termination status
-            if (status != NULL) {
-                *status = LWPTERMSTAT(terminated_thread->status);
-            }
+    if (self == NULL || live_count - waiter_count <= 1) {
+        LIB_UNLOCK();
+        return NO_THREAD;
+    }
 
-            // Deallocate resources associated with the terminated thread, but
-            // don't free the stack of the system thread
-            // Assuming tid 1 is the system thread
-            if (terminated_thread->tid != 1) {
-                free(terminated_thread->stack);
-            }
+    // Block until lwp_exit() gives us a zombie
+    self->exited = NULL;
+    tq_push(&waiters, self);
+    waiter_count++;
+    LIB_UNLOCK();
+    while ((zombie = __atomic_load_n(&self->exited, __ATOMIC_ACQUIRE)) == NULL) {
+        lwp_park();
+    }
+    self->exited = NULL;
+    return reap(zombie, status);
+}
+
+
+// Like lwp_wait(), but gives up and returns NO_THREAD if nothing has
+// exited within usec microseconds
+tid_t lwp_wait_timeout(int *status, unsigned long usec) {
+    thread self = current_thread;
+    thread zombie;
+    lwp_timer tm;
 
-            // Remove the terminated thread from the scheduler
-            current_sched->remove(terminated_thread);
-            
-            // Return the terminated thread's ID
-            return terminated_thread->tid;
+    LIB_LOCK();
+    zombie = zombie_pop();
+    if (zombie != NULL) {
+        LIB_UNLOCK();
+        return reap(zombie, status);
+    }
+    if (self == NULL || usec == 0 || live_count - waiter_count <= 1) {
+        LIB_UNLOCK();
+        return NO_THREAD;
+    }
+    self->exited = NULL;
+    tq_push(&timed_waiters, self);
+    LIB_UNLOCK();
+
+    timer_start(&tm, usec);
+    while ((zombie = __atomic_load_n(&self->exited, __ATOMIC_ACQUIRE)) == NULL &&
+           !__atomic_load_n(&tm.fired, __ATOMIC_ACQUIRE)) {
+        lwp_park();
+    }
+    timer_cancel(&tm);
+
+    if (zombie == NULL) {
+        // Timed out, unless lwp_exit() got to us first after all
+        LIB_LOCK();
+        if (!tq_remove(&timed_waiters, self)) {
+            zombie = self->exited;
+        }
+        LIB_UNLOCK();
+        if (zombie == NULL) {
+            return NO_THREAD;
         }
     }
+    self->exited = NULL;
+    return reap(zombie, status);
+}
+
+
+// Blocks the calling thread until lwp_unpark() gives it a permit. If
+// one is already waiting, it's used up and this returns at once. Like
+// any park, it can return without a matching unpark if the permit was
+// left over from earlier, so callers should recheck their condition.
+void lwp_park(void) {
+    thread self = current_thread;
+    int state = LWP_PERMIT;
+
+    if (self == NULL) {
+        return;
+    }
+    if (__atomic_compare_exchange_n(&self->parkstate, &state, LWP_RUNNING,
+                                    FALSE, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+        return;
+    }
 
-    // If no terminated threads, block the current thread
-    // First, check if there are no more threads that can be terminated
-    if (current_sched->qlen() <= 1) {
-        return NO_THREAD;  // No more threads to wait for
+    preempt_off();
+    __atomic_add_fetch(&parked_count, 1, __ATOMIC_SEQ_CST);
+    state = LWP_RUNNING;
+    if (!__atomic_compare_exchange_n(&self->parkstate, &state, LWP_PARKED,
+                                     FALSE, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED)) {
+        // An unpark got in first. We're still on the run queue, as the
+        // running thread, so there's nothing to undo but the count.
+        __atomic_sub_fetch(&parked_count, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&self->parkstate, LWP_RUNNING, __ATOMIC_RELAXED);
+        preempt_on();
+        return;
     }
+    TRACE(TRACE_BLOCK, self->tid, cur_worker()->id);
+
+    // From here the unpark can happen at any moment, even before we've
+    // left the run queue; but it goes through our own inbox, which only
+    // this worker drains, and only in reschedule(), so we're off the
+    // queue before we can be put back on it, and can't be lost.
+    sched_unqueue(self);
+    reschedule();
+    preempt_on();
+}
 
-    // Block the current thread (remove it from the scheduler)
-    current_sched->remove(current_thread);
 
-    // Add it to the waiting queue
-    enqueue(current_thread);
+// Makes t runnable if it's parked, or gives it a permit so its next
+// lwp_park() returns immediately. This is lock-free and may be called
+// from any kernel thread, LWP or not, and from signal handlers. It takes
+// a thread rather than a tid because tid2thread() takes the library
+// lock; the caller has to know t won't be reaped meanwhile (the library
+// pins it; see thread_pin()).
+void lwp_unpark(thread t) {
+    int state;
 
-    // Block until another thread exits
-    while (1) {
-        // If there are terminated threads, unblock and process
-        if (current_sched->qlen() > 1) {
-            lwp_exit_blocked(&waiting_queue);
+    if (t == NULL) {
+        return;
+    }
+    state = __atomic_load_n(&t->parkstate, __ATOMIC_SEQ_CST);
+    for (;;) {
+        if (state == LWP_PERMIT) {
+            return;  // permits don't accumulate
+        }
+        if (state == LWP_PARKED) {
+            if (__atomic_compare_exchange_n(&t->parkstate, &state,
+                                            LWP_RUNNING, FALSE,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_SEQ_CST)) {
+                if (stats_timing) {
+                    __atomic_store_n(&t->stamp, __builtin_ia32_rdtsc(),
+                                     __ATOMIC_RELAXED);
+                }
+                TRACE(TRACE_WAKE, t->tid, cur_worker()->id);
+                inbox_push(worker_of(t), t);
+                __atomic_sub_fetch(&parked_count, 1, __ATOMIC_SEQ_CST);
+                return;
+            }
+        } else if (__atomic_compare_exchange_n(&t->parkstate, &state,
+                                               LWP_PERMIT, FALSE,
+                                               __ATOMIC_SEQ_CST,
+                                               __ATOMIC_SEQ_CST)) {
+            return;
         }
     }
 }
 
 
+// Keeps t from being reaped until a matching thread_unpin()
+void thread_pin(thread t) {
+    __atomic_add_fetch(&t->pins, 1, __ATOMIC_SEQ_CST);
+}
+
+
+void thread_unpin(thread t) {
+    __atomic_sub_fetch(&t->pins, 1, __ATOMIC_RELEASE);
+}
+
+
+// Like lwp_unpark(), but a thread that was parked on the caller's worker
+// is also made the very next thread to run there when the caller blocks
+// or yields, without going through the scheduler. For handing work
+// straight to the thread that's waiting for it. Not for signal handlers.
+void lwp_handoff(thread t) {
+    worker *w;
+    int state = LWP_PARKED;
+
+    preempt_off();  // stay on this worker
+    w = cur_worker();
+    if (t == NULL || w->current == NULL ||
+        (multicore && t->home != w->id) ||
+        !__atomic_compare_exchange_n(&t->parkstate, &state, LWP_RUNNING,
+                                     FALSE, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_SEQ_CST)) {
+        preempt_on();
+        lwp_unpark(t);
+        return;
+    }
+
+    // t is ours now, and being parked on this worker it's all the way
+    // off the CPU
+    if (stats_timing) {
+        t->stamp = __builtin_ia32_rdtsc();
+    }
+    TRACE(TRACE_WAKE, t->tid, w->id);
+    if (w->runnext != NULL) {
+        current_sched->admit(w->runnext);  // it loses its place
+    }
+    w->runnext = t;
+    __atomic_sub_fetch(&parked_count, 1, __ATOMIC_SEQ_CST);
+    preempt_on();
+}
+
+
 // Returns the thread ID of the calling LWP
 tid_t lwp_gettid(void) {
     // Check if there is a valid current thread (i.e., an LWP is running)
@@ -373,47 +2275,201 @@ tid_t lwp_gettid(void) {
 }
 
 
-// Converts tid to thread structure
+// Returns the calling LWP's own thread, or NULL outside of any LWP
+thread lwp_self(void) {
+    return current_thread;
+}
+
+
+// Converts tid to thread structure, or NULL if there is no such thread
+// (it never existed or has already been reaped)
 thread tid2thread(tid_t tid) {
-    // Start with the first thread in the scheduler
-    thread temp_thread = current_sched->next();
-    
-    // Iterate through the scheduler to find the thread with the matching tid
-    while (temp_thread != NULL) {
-        if (temp_thread->tid == tid) {
-            return temp_thread;  // Return the thread if the tid matches
+    thread found = NULL;
+    size_t i;
+
+    if (tid == NO_THREAD) {
+        return NULL;
+    }
+    LIB_LOCK();
+    for (i = tid & tid_mask; tid_table != NULL && tid_table[i] != NULL;
+         i = (i + 1) & tid_mask) {
+        if (tid_table[i]->tid == tid) {
+            found = tid_table[i];
+            break;
         }
-        // Move to the next thread in the scheduler
-        temp_thread = temp_thread->sched_one;
     }
-    
-    return NULL;  // Return NULL if no matching thread is found
+    LIB_UNLOCK();
+    return found;
+}
+
+
+// Fills in counters (if it isn't NULL) and up to max entries of threads
+// with the statistics of threads that haven't been reaped yet, in no
+// particular order. Returns how many entries it filled in. Threads
+// running on other workers go on running meanwhile, so their numbers
+// can be a switch out of date.
+int lwp_stats(lwp_counters *counters, lwp_threadstats *threads, int max) {
+    double scale = tsc_scale();
+    unsigned long long now;
+    int filled = 0, i;
+    size_t j;
+
+    LIB_LOCK();
+    now = __builtin_ia32_rdtsc();
+    for (j = 0; tid_table != NULL && j <= tid_mask && filled < max; j++) {
+        thread t = tid_table[j];
+        lwp_threadstats *ts = &threads[filled];
+        unsigned long long run, stamp;
+
+        if (t == NULL) {
+            continue;
+        }
+        run = t->run_tsc;
+        stamp = __atomic_load_n(&t->stamp, __ATOMIC_RELAXED);
+        if (stats_timing && __atomic_load_n(&t->oncpu, __ATOMIC_ACQUIRE) &&
+            stamp < now) {
+            run += now - stamp;  // and the slice it's in the middle of
+        }
+        ts->tid = t->tid;
+        ts->scheduled = t->nsched;
+        ts->yields = t->nyields;
+        ts->run_ns = run * scale;
+        ts->wait_ns = t->wait_tsc * scale;
+        ts->stack_peak = t->stack_peak;
+        if (t->stack_marked && stack_mark_depth(t) > ts->stack_peak) {
+            ts->stack_peak = stack_mark_depth(t);
+        }
+        filled++;
+    }
+    if (counters != NULL) {
+        memset(counters, 0, sizeof(*counters));
+        for (i = 0; i < (multicore ? nworkers : 1); i++) {
+            worker *w = multicore ? workers[i] : &boot_worker;
+            counters->switches += w->switches;
+            if (w->runq_peak > counters->runq_peak) {
+                counters->runq_peak = w->runq_peak;
+            }
+        }
+        counters->spawns = spawn_count;
+        counters->reaps = reap_count;
+        counters->nthreads = tid_count;
+    }
+    LIB_UNLOCK();
+    return filled;
+}
+
+
+// Turns on (or off) the timing and stack depth parts of lwp_stats().
+// They cost a TSC read at every switch and wakeup, which is about as much
+// as the switch itself, so they're off by default; the counts are kept
+// regardless. Everything starts its clock afresh when they go on.
+void lwp_set_stats(int on) {
+    unsigned long long now;
+    size_t j;
+
+    LIB_LOCK();
+    if (on && !stats_timing) {
+        now = __builtin_ia32_rdtsc();
+        for (j = 0; tid_table != NULL && j <= tid_mask; j++) {
+            if (tid_table[j] != NULL) {
+                __atomic_store_n(&tid_table[j]->stamp, now, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    stats_timing = on;
+    LIB_UNLOCK();
+}
+
+
+// Changes a thread's priority (clamped to 0..LWP_PRIO_LEVELS-1) and
+// returns the old one, or -1 if there is no such thread. Run queues
+// belong to their worker, so with several workers only threads living
+// on the caller's worker can be changed.
+int lwp_set_priority(tid_t tid, int prio) {
+    thread t = tid2thread(tid);
+    int old;
+
+    if (t == NULL || (multicore && t->home != cur_worker()->id)) {
+        return -1;
+    }
+    if (prio < 0) prio = 0;
+    if (prio >= LWP_PRIO_LEVELS) prio = LWP_PRIO_LEVELS - 1;
+
+    preempt_off();
+    old = t->prio;
+    t->prio = prio;
+    if (old != prio && current_sched->reprio) {
+        current_sched->reprio(t, old);
+    }
+    preempt_on();
+    return old;
 }
 
 
-// Sets a new scheduler
+// Returns a thread's priority, or -1 if there is no such thread
+int lwp_get_priority(tid_t tid) {
+    thread t = tid2thread(tid);
+    return t != NULL ? t->prio : -1;
+}
+
+
+// Sets a thread's share for Stride and Lottery (clamped to
+// 1..LWP_MAX_TICKETS) and returns the old one, or -1 if there is no such
+// thread. Stride charges a thread by the tickets it has when it yields,
+// and Lottery reads them again whenever the thread has run, so a change
+// takes effect from the thread's next turn without any requeueing, and
+// this works from any worker.
+int lwp_set_tickets(tid_t tid, int tickets) {
+    thread t = tid2thread(tid);
+    int old;
+
+    if (t == NULL) {
+        return -1;
+    }
+    if (tickets < 1) tickets = 1;
+    if (tickets > LWP_MAX_TICKETS) tickets = LWP_MAX_TICKETS;
+    old = t->tickets > 0 ? t->tickets : LWP_DEFAULT_TICKETS;
+    t->tickets = tickets;
+    return old;
+}
+
+
+// Sets a new scheduler. With several workers this has to happen before
+// lwp_start(), since each worker's run queue lives in its own kernel
+// thread; later calls are ignored.
 void lwp_set_scheduler(scheduler sched) {
-    if (sched == NULL) {
-        // If NULL, reset to round-robin scheduler
-        current_sched = RoundRobin; 
+    scheduler prev_sched = current_sched;
+    thread list;
+    int n;
+
+    if (multicore) {
         return;
     }
+    if (sched == NULL) {
+        sched = RoundRobin;  // NULL means back to the default
+    }
+    if (sched == prev_sched) {
+        return;  // moving the threads to where they are would never end
+    }
+    preempt_off();  // the run queue is in pieces until we're done
+
+    if (sched->init) {
+        sched->init();
+    }
 
-    // Otherwise, transfer all threads to the new scheduler
-    thread temp_thread = current_sched->next();  // Get the first thread
-    while (temp_thread != NULL) {
-        // Store the old scheduler for removal
-        scheduler old_sched = current_sched;
-        // Remove the thread from the old scheduler
-        current_sched->remove(temp_thread);
-        // Add it to the new scheduler
-        sched->admit(temp_thread);
-        // Move to the next thread
-        temp_thread = old_sched->next();
+    // Transfer all threads to the new scheduler, in bulk where the two
+    // schedulers can manage it
+    list = sched_drain(prev_sched, &n);
+    if (n > 0) {
+        sched_admit_batch(sched, list, n);
     }
 
     // Now set the current scheduler to the new scheduler
     current_sched = sched;
+    if (prev_sched->shutdown) {
+        prev_sched->shutdown();
+    }
+    preempt_on();
 }
 
 
@@ -1,6 +1,7 @@
 #ifndef LWPH
 #define LWPH
 #include <sys/types.h>
+#include <sys/socket.h>
 
 #ifndef TRUE
 #define TRUE 1
@@ -46,15 +47,61 @@ typedef struct threadinfo_st {
   size_t        stacksize;      /* Size of allocated stack */
   rfile         state;          /* saved registers         */
   unsigned int  status;         /* exited? exit status?    */
+  unsigned int  flags;          /* LWP_NOFPU, etc.         */
+  int           home;           /* worker that runs it     */
+  int           oncpu;          /* being run right now?    */
+  int           preempt_off;    /* preemption mask depth   */
+  int           prio;           /* for priority schedulers */
+  int           parkstate;      /* lwp_park() permit       */
+  int           pins;           /* wakers not done with it */
+  thread        wake_next;      /* worker inbox link       */
+  int           tickets;        /* for proportional share  */
+  unsigned long pass;           /* Stride's virtual time   */
+  int           sched_pos;      /* and its heap slot       */
   thread        lib_one;        /* Two pointers reserved   */
   thread        lib_two;        /* for use by the library  */
   thread        sched_one;      /* Two more for            */
   thread        sched_two;      /* schedulers to use       */
   thread        exited;         /* and one for lwp_wait()  */
+  unsigned long nsched;         /* for lwp_stats(): runs,  */
+  unsigned long nyields;        /* lwp_yield() calls,      */
+  unsigned long long run_tsc;   /* TSC ticks on a CPU,     */
+  unsigned long long wait_tsc;  /* and runnable off it,    */
+  unsigned long long stamp;     /* since this switch/wake  */
+  size_t        stack_peak;     /* deepest, at a switch    */
+  size_t        stack_marked;   /* canary below the top    */
+  int         (*entry)(void *); /* what it was created with*/
+  size_t        stack_mapped;   /* LWP_GROWABLE: so far    */
 } context;
 
 typedef int (*lwpfun)(void *);  /* type for lwp function */
 
+/* flags for lwp_create_flags() and lwp_attr */
+#define LWP_NOFPU         0x1   /* thread never touches x87/SSE state */
+#define LWP_GROWABLE      0x2   /* stack starts small and grows      */
+
+/* Attributes for lwp_create_ex().  Zero-filled means "the defaults". */
+typedef struct lwp_attr {
+  size_t        stacksize;      /* usable stack bytes; 0 for RLIMIT_STACK */
+  unsigned int  flags;          /* LWP_NOFPU, etc.                        */
+  int           prio;           /* initial priority (see lwp_set_priority) */
+  int           tickets;        /* initial share (see lwp_set_tickets)     */
+} lwp_attr;
+
+#define LWP_DEFAULT_STACK (8*1024*1024) /* when RLIMIT_STACK is unlimited */
+#define LWP_MIN_STACK     (16*1024)     /* leaves room for signal frames  */
+#define LWP_GROW_INITIAL  (16*1024)     /* what an LWP_GROWABLE stack has */
+
+/* An LWP_GROWABLE thread's stack is a reservation of stacksize bytes
+ * (the cap), of which only the top LWP_GROW_INITIAL is mapped at first.
+ * Touching the unmapped part below faults, and a SIGSEGV handler running
+ * on a sigaltstack maps more (at least doubling it, and always a little
+ * beyond the fault so signal frames fit) and lets the thread carry on.
+ * Past the cap it's an ordinary stack overflow.  The library's handler
+ * passes on any other SIGSEGV to the one installed before it.
+ * Growable stacks aren't kept in the stack pool.
+ */
+
 /* Tuple that describes a scheduler */
 typedef struct scheduler {
   void   (*init)(void);            /* initialize any structures     */
@@ -63,18 +110,279 @@ typedef struct scheduler {
   void   (*remove)(thread victim); /* remove a thread from the pool */
   thread (*next)(void);            /* select a thread to schedule   */
   int    (*qlen)(void);            /* number of ready threads       */
+  void   (*reprio)(thread t, int old); /* t->prio changed (optional) */
+  void   (*admit_batch)(thread list, int n); /* add n at once (optional) */
+  thread (*drain)(int *n);         /* remove them all (optional)    */
 } *scheduler;
 
+/* admit_batch and drain pass threads as a circular list through
+ * sched_one (next) and sched_two (prev), given by its first thread, in
+ * the order they should run; NULL is the empty list.  A scheduler that
+ * keeps its own queue that way can splice whole lists in O(1), as
+ * RoundRobin does for both.  They only have to save the per-thread
+ * calls: Priority's drain joins its levels' lists (O(levels)) and its
+ * admit_batch is left out, Lottery's admit_batch costs O(log n) a thread
+ * and its drain O(n), and Stride and WorkStealing have neither.  drain
+ * takes everything, including the running thread if the scheduler holds
+ * on to it, and leaves the scheduler empty.  Without them the library
+ * falls back to admit, and to next and remove, a thread at a time.
+ */
+
+extern scheduler RoundRobin;    /* the default */
+extern scheduler WorkStealing;  /* per-worker deques, idle workers steal */
+extern scheduler Priority;      /* highest prio first, FIFO within one */
+extern scheduler Stride;        /* CPU in proportion to tickets */
+extern scheduler Lottery;       /* the same, on average, by random draw */
+
+#define LWP_PRIO_LEVELS   64    /* priorities are 0 (default) .. 63 */
+#define LWP_DEFAULT_TICKETS 100 /* share of a thread with tickets 0 */
+#define LWP_MAX_TICKETS   (1<<20)
+
+/* With lwp_set_workers(n), n > 1, each of the n kernel threads calls the
+ * scheduler only for its own threads, so a scheduler's state must be per
+ * kernel thread (__thread), as RoundRobin's is.  lwp_start() calls init
+ * again, with the threads admitted so far still queued, once
+ * lwp_get_workers() is final, so anything sized by it can be resized
+ * there.
+ */
+
+/* counters reported by lwp_stack_pool_stats() */
+typedef struct lwp_poolstats {
+  unsigned long hits;           /* creates served from the pool     */
+  unsigned long misses;         /* creates that had to mmap a stack */
+  size_t        cached;         /* stacks currently in the pool     */
+} lwp_poolstats;
+
+/* Reported by lwp_stats().  Times and stack depth are only kept while
+ * lwp_set_stats() has them on.  Times are measured with the TSC at every
+ * switch and converted to nanoseconds.  Stack depth is sampled when the
+ * thread is switched out, so a deeper excursion in between is missed,
+ * unless the stack carries a canary (LWP_STACK_MEASURE); then it's the
+ * high-water mark, whether or not lwp_set_stats() is on.
+ */
+typedef struct lwp_threadstats {
+  tid_t         tid;
+  unsigned long scheduled;      /* times switched to             */
+  unsigned long yields;         /* lwp_yield() calls             */
+  unsigned long long run_ns;    /* time running                  */
+  unsigned long long wait_ns;   /* time runnable but not running */
+  size_t        stack_peak;     /* deepest stack use, bytes    */
+} lwp_threadstats;
+
+typedef struct lwp_counters {
+  unsigned long switches;       /* context switches, all workers */
+  unsigned long spawns;         /* threads created               */
+  unsigned long reaps;          /* threads reaped by lwp_wait()  */
+  int           runq_peak;      /* longest run queue seen        */
+  int           nthreads;       /* threads not yet reaped        */
+} lwp_counters;
+
+/* Stack sizing (lwp_set_stack_policy()).  With LWP_STACK_MEASURE, new
+ * threads get up to LWP_STACK_MARK bytes at the top of their stack
+ * filled with a canary, and the deepest point where it's been
+ * overwritten is the thread's high-water mark: exact, unlike the sample
+ * taken at switches.  It shows up in lwp_stats(), and when a thread is
+ * reaped it goes into a profile of its entry function
+ * (lwp_stack_profiles()).  The canary costs a memset of that much at
+ * every create and commits it as memory.
+ *
+ * With LWP_STACK_ADAPT as well, a thread created with the default stack
+ * size whose function has been measured LWP_STACK_ADAPT_MIN times gets
+ * twice the deepest of those instead (but at least LWP_MIN_STACK and at
+ * most the default), unless one of them went past the canary.  That
+ * stack is growable (see LWP_GROWABLE) with the default size as its cap
+ * and just the adapted size mapped to begin with, so a thread that goes
+ * deeper than any before it grows its stack rather than overflowing, and
+ * how deep it really went counts towards its function's profile.  Being
+ * growable, adapted stacks aren't pooled: each such create maps a fresh
+ * stack and each exit unmaps it, which LWP_STACK_ADAPT trades for the
+ * memory it saves.
+ */
+#define LWP_STACK_MEASURE   0x1
+#define LWP_STACK_ADAPT     0x2
+#define LWP_STACK_MARK      (256*1024)
+#define LWP_STACK_ADAPT_MIN 8
+
+typedef struct lwp_stackprofile {
+  lwpfun        function;
+  unsigned long threads;        /* how many have been measured   */
+  size_t        peak;           /* deepest any of them went      */
+  int           overflowed;     /* one went past the canary      */
+  size_t        size;           /* what LWP_STACK_ADAPT maps     */
+} lwp_stackprofile;
+
+/* What a worker does when it has nothing to run (lwp_set_idle()).  It
+ * spins for spin_ns watching for work, which is the fastest way to pick
+ * up a thread unparked from elsewhere (but only if there are CPUs to
+ * spare for whoever will do that), and then sleeps: in the I/O
+ * reactor if anything is waiting on fds or timers, in poll() if there is
+ * one, and otherwise on a futex.  Sleeps end as soon as there's work,
+ * except that while there is work that can only be found by looking
+ * (another worker's queue to steal from, or both the reactor and poll()
+ * to watch) they last at most latency_us; 0 means only wake when woken.
+ *
+ * poll() is an outside event source, such as another event loop: it
+ * waits up to max_ms (-1: until wake() is called), lwp_unpark()s the
+ * threads its events are for, and returns how many.  With several
+ * workers it must be thread-safe; it's also called with 0 now and then
+ * while they're busy.  wake() must be async-signal-safe.
+ */
+typedef struct lwp_idle {
+  unsigned long spin_ns;        /* spin this long before sleeping */
+  unsigned long latency_us;     /* longest sleep while polling    */
+  int         (*poll)(int max_ms);  /* optional event source     */
+  void        (*wake)(void);        /* interrupts a blocked poll() */
+} lwp_idle;
+
+#define LWP_IDLE_SPIN_NS    20000   /* defaults */
+#define LWP_IDLE_LATENCY_US 1000
+
+/* Event tracer (trace.c).  Between lwp_trace_start() and lwp_trace_stop()
+ * the library records thread creation, switches in and out, parking,
+ * wakeups and exits, with TSC timestamps, keeping the most recent events
+ * (default LWP_TRACE_EVENTS).  lwp_trace_dump() writes them to a file,
+ * and the lwptrace tool turns that into Chrome trace JSON for
+ * chrome://tracing or ui.perfetto.dev.  While it's off it costs one
+ * predicted branch at each of those points.
+ */
+#define LWP_TRACE_EVENTS  (1<<20)
+
+/* Blocking synchronization (sync.c).  Waiters are parked off the run
+ * queue and the resource is handed straight to the first of them.
+ * Only LWPs may block on these.  Zero-filled (or the initializers) means
+ * unlocked / no waiters.
+ */
+typedef struct lwp_mutex {
+  int           lock;           /* protects the fields below */
+  thread        owner;
+  thread        waiters;        /* through lib_one/lib_two   */
+} lwp_mutex;
+
+typedef struct lwp_cond {
+  int           lock;
+  lwp_mutex     *mutex;         /* the one its waiters hold  */
+  thread        waiters;
+} lwp_cond;
+
+typedef struct lwp_sem {
+  int           lock;
+  int           count;
+  thread        waiters;
+} lwp_sem;
+
+#define LWP_MUTEX_INITIALIZER { 0, NULL, NULL }
+#define LWP_COND_INITIALIZER  { 0, NULL, NULL }
+
+/* Bounded channel of fixed-size elements (sync.c) */
+typedef struct lwp_chan lwp_chan;
+
+/* a channel of up to cap values of type */
+#define LWP_CHAN(type, cap) lwp_chan_create(sizeof(type), (cap))
+
+#define LWP_TIMEOUT (-2)        /* a channel operation timed out */
+
 /* lwp functions */
 extern tid_t lwp_create(lwpfun,void *);
+extern tid_t lwp_create_flags(lwpfun,void *,unsigned int flags);
+extern tid_t lwp_create_ex(lwpfun,void *,const lwp_attr *attr);
+extern int   lwp_create_many(lwpfun,void *args[],int n,tid_t tids[]);
 extern void  lwp_exit(int status);
 extern tid_t lwp_gettid(void);
+extern thread lwp_self(void);
 extern void  lwp_yield(void);
 extern void  lwp_start(void);
 extern tid_t lwp_wait(int *);
+extern tid_t lwp_wait_timeout(int *, unsigned long usec);
 extern void  lwp_set_scheduler(scheduler fun);
 extern scheduler lwp_get_scheduler(void);
+extern void  lwp_set_workers(int n);
+extern int   lwp_get_workers(void);
+extern int   lwp_worker_id(void);
 extern thread tid2thread(tid_t tid);
+extern void  lwp_park(void);
+extern void  lwp_unpark(thread t);      /* also from pthreads and signals */
+extern void  lwp_handoff(thread t);     /* unpark t and run it next */
+
+/* Once lwp_start() has been called, a kernel thread that isn't one of
+ * the workers (a plain pthread) may only call lwp_unpark(),
+ * lwp_handoff() (which is just lwp_unpark() there) and lwp_sem_post(),
+ * and lwp_worker_id() returns -1 on it.  Anything that creates threads,
+ * blocks, yields or touches a run queue must be called from an LWP.
+ */
+
+/* Blocking calls that park only the calling LWP (io.c).  Outside an LWP
+ * they behave like the system calls they're named after.
+ */
+extern ssize_t lwp_read(int fd, void *buf, size_t count);
+extern ssize_t lwp_write(int fd, const void *buf, size_t count);
+extern int   lwp_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+extern void  lwp_sleep(unsigned long usec);
+
+/* The *_timeout and timed calls give up after usec microseconds, to the
+ * nearest millisecond (timer.c).  The ones that return int return 1 on
+ * success and 0 on timeout, except for channels, which return 0, -1 if
+ * the channel is closed, or LWP_TIMEOUT.
+ */
+
+extern int   lwp_mutex_init(lwp_mutex *m);
+extern void  lwp_mutex_lock(lwp_mutex *m);
+extern int   lwp_mutex_trylock(lwp_mutex *m);
+extern int   lwp_mutex_timedlock(lwp_mutex *m, unsigned long usec);
+extern void  lwp_mutex_unlock(lwp_mutex *m);
+extern int   lwp_cond_init(lwp_cond *c);
+extern void  lwp_cond_wait(lwp_cond *c, lwp_mutex *m);
+extern void  lwp_cond_signal(lwp_cond *c);
+extern void  lwp_cond_broadcast(lwp_cond *c);
+extern int   lwp_sem_init(lwp_sem *s, int count);
+extern void  lwp_sem_wait(lwp_sem *s);
+extern int   lwp_sem_trywait(lwp_sem *s);
+extern int   lwp_sem_timedwait(lwp_sem *s, unsigned long usec);
+extern void  lwp_sem_post(lwp_sem *s);
+extern lwp_chan *lwp_chan_create(size_t elemsize, size_t capacity);
+extern void  lwp_chan_destroy(lwp_chan *ch);
+extern void  lwp_chan_close(lwp_chan *ch);
+extern int   lwp_chan_send(lwp_chan *ch, const void *elem);
+extern int   lwp_chan_recv(lwp_chan *ch, void *elem);
+extern int   lwp_chan_send_timeout(lwp_chan *ch, const void *elem,
+                                   unsigned long usec);
+extern int   lwp_chan_recv_timeout(lwp_chan *ch, void *elem,
+                                   unsigned long usec);
+extern int   lwp_chan_send_batch(lwp_chan *ch, const void *elems, int n);
+extern int   lwp_chan_recv_batch(lwp_chan *ch, void *elems, int max);
+extern void  lwp_stack_pool_config(size_t max_cached, int trim);
+extern void  lwp_stack_pool_stats(lwp_poolstats *stats);
+extern void  lwp_set_stack_policy(int policy);
+extern int   lwp_stack_profiles(lwp_stackprofile *profiles, int max);
+extern int   lwp_stats(lwp_counters *counters, lwp_threadstats *threads,
+                       int max);
+extern void  lwp_set_stats(int on);
+extern int   lwp_trace_start(size_t events);
+extern void  lwp_trace_stop(void);
+extern int   lwp_trace_dump(const char *path);
+extern int   lwp_set_priority(tid_t tid, int prio);
+extern int   lwp_get_priority(tid_t tid);
+extern int   lwp_set_tickets(tid_t tid, int tickets);
+extern void  lwp_set_preemption(unsigned long usec);
+extern int   lwp_set_idle(const lwp_idle *policy);
+extern void  lwp_get_idle(lwp_idle *policy);
+extern void  lwp_preempt_disable(void);
+extern void  lwp_preempt_enable(void);
+
+/* Preemption is off by default.  With lwp_set_preemption(usec), a thread
+ * that runs for usec of CPU time without yielding is switched out by a
+ * SIGVTALRM handler.  The library masks preemption around its own work,
+ * but the program must bracket anything else that is not
+ * async-signal-safe (malloc, stdio, ...) with lwp_preempt_disable() and
+ * lwp_preempt_enable().  Blocking system calls are restarted.  Threads
+ * with LWP_GROWABLE stacks are never preempted, since the signal frame
+ * could run past what's mapped of their stack; the timer is stopped
+ * while one runs.
+ */
+
+/* parkstate values */
+#define LWP_RUNNING       0     /* no permit */
+#define LWP_PARKED        1     /* blocked in lwp_park()  */
+#define LWP_PERMIT        2     /* next lwp_park() returns at once */
 
 /* for lwp_wait */
 #define TERMOFFSET        8
@@ -86,5 +394,6 @@ extern thread tid2thread(tid_t tid);
 
 /* prototypes for asm functions */
 void swap_rfiles(rfile *old, rfile *new);
+void swap_rfiles_nofp(rfile *old, rfile *new); /* integer regs only */
 
 #endif
@@ -0,0 +1,455 @@
+/*
+ * lwpbench: headless microbenchmarks for the LWP library.
+ *
+ * usage: lwpbench [-f text|csv|json] [iterations]
+ *
+ * yield: NTHREADS threads that each call lwp_yield() `iterations`
+ *        times, once with full FPU save/restore and once with
+ *        LWP_NOFPU.  The main thread sits in lwp_wait() meanwhile.
+ *        "roundtrip" is the same with two threads, so every yield
+ *        goes to the other one and back.
+ *
+ * create: lwp_create() and lwp_wait() of CREATE_TOTAL trivial threads,
+ *        CREATE_BATCH at a time, and the same with lwp_create_many().
+ *
+ * next:  the cost of each scheduler's next() with 10, 1000 and 100000
+ *        threads queued, measured on dummy contexts that are never run,
+ *        so it is the scheduler alone.
+ *
+ * memory: resident and virtual memory per LWP, over MEM_THREADS threads
+ *        with the default stack that have each run and parked.
+ *
+ * sched: NWORKERS kernel threads running NCOMPUTE compute threads under
+ *        RoundRobin and under WorkStealing.  "balanced" gives every
+ *        thread the same work and reports Jain's fairness index of
+ *        their progress at the moment the first one finishes (1.0 is
+ *        perfectly fair).  "skewed" gives every NWORKERS-th thread (so
+ *        all of one worker's threads) four times the work and reports
+ *        how long the whole batch takes.
+ *
+ * Each measurement runs in its own forked child so that leftover
+ * threads from one run cannot disturb the next.  Results are printed
+ * as a table, or with -f as CSV (name,value,unit) or JSON for
+ * regression tracking.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "lwp.h"
+
+#define NTHREADS       8
+#define DEFAULT_ITERS  1000000L
+#define NWORKERS       4
+#define NCOMPUTE       64
+#define UNITS          100      /* work units per compute thread */
+#define SPIN_PER_UNIT  20000    /* loop iterations in one unit */
+#define CREATE_TOTAL   100000   /* threads created per create run */
+#define CREATE_BATCH   1000     /* created before waiting for them */
+#define NEXT_CALLS     1000000L /* next() calls per measurement */
+#define MEM_THREADS    1000
+#define MAX_RESULTS    4
+#define MAX_RECORDS    64
+
+static long iterations = DEFAULT_ITERS;
+
+/* parameters for the child, set before forking */
+static unsigned int bench_flags = 0;
+static scheduler bench_scheduler = NULL;
+static int skewed = FALSE;
+static int use_many = FALSE;
+static int queued = 0;
+
+/* compute-thread bookkeeping */
+static long progress[NCOMPUTE];
+static long units[NCOMPUTE];
+static double progress_at_first[NCOMPUTE];
+static int first_done = FALSE;
+
+/* the results, in the order they were measured */
+typedef struct record {
+    char        name[48];
+    double      value;
+    const char *unit;
+} record;
+
+static record records[MAX_RECORDS];
+static int nrecords = 0;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void add_record(const char *name, double value, const char *unit) {
+    if (nrecords < MAX_RECORDS) {
+        snprintf(records[nrecords].name, sizeof(records[nrecords].name),
+                 "%s", name);
+        records[nrecords].value = value;
+        records[nrecords].unit = unit;
+        nrecords++;
+    }
+}
+
+static int yielder(void *arg) {
+    long i;
+    for (i = 0; i < iterations; i++) {
+        lwp_yield();
+    }
+    return 0;
+}
+
+// Runs NTHREADS yielders with bench_flags; reports ns per switch
+static void bench_yield(double *out) {
+    double start, elapsed;
+    int i;
+
+    for (i = 0; i < NTHREADS; i++) {
+        lwp_create_flags(yielder, NULL, bench_flags);
+    }
+    start = now_ns();
+    for (i = 0; i < NTHREADS; i++) {
+        lwp_wait(NULL);
+    }
+    elapsed = now_ns() - start;
+    out[0] = elapsed / ((double)iterations * NTHREADS);
+}
+
+// Two yielders bouncing between each other; reports ns per round trip
+static void bench_roundtrip(double *out) {
+    double start;
+
+    lwp_create(yielder, NULL);
+    lwp_create(yielder, NULL);
+    start = now_ns();
+    lwp_wait(NULL);
+    lwp_wait(NULL);
+    out[0] = (now_ns() - start) / iterations;
+}
+
+static int trivial(void *arg) {
+    return 0;
+}
+
+// Creates and reaps CREATE_TOTAL threads; reports ns per thread
+static void bench_create(double *out) {
+    double start;
+    int done, i;
+
+    start = now_ns();
+    for (done = 0; done < CREATE_TOTAL; done += CREATE_BATCH) {
+        if (use_many) {
+            lwp_create_many(trivial, NULL, CREATE_BATCH, NULL);
+        } else {
+            for (i = 0; i < CREATE_BATCH; i++) {
+                lwp_create(trivial, NULL);
+            }
+        }
+        for (i = 0; i < CREATE_BATCH; i++) {
+            lwp_wait(NULL);
+        }
+    }
+    out[0] = (now_ns() - start) / CREATE_TOTAL;
+}
+
+// Queues `queued` dummy contexts on bench_scheduler and calls its next()
+// over and over; reports ns per next() and per admit()
+static void bench_next(double *out) {
+    scheduler s = bench_scheduler;
+    context *dummies = calloc(queued, sizeof(context));
+    long calls = NEXT_CALLS, i;
+    double start;
+
+    if (dummies == NULL) {
+        return;
+    }
+    if (s->init) {
+        s->init();
+    }
+    for (i = 0; i < queued; i++) {
+        dummies[i].tid = i + 1;      // and fault the pages in
+    }
+    start = now_ns();
+    for (i = 0; i < queued; i++) {
+        s->admit(&dummies[i]);
+    }
+    out[1] = (now_ns() - start) / queued;
+    start = now_ns();
+    for (i = 0; i < calls; i++) {
+        s->next();
+    }
+    out[0] = (now_ns() - start) / calls;
+}
+
+static int parked = 0;
+static int release = FALSE;
+static thread mem_threads[MEM_THREADS];
+
+static int parker(void *arg) {
+    mem_threads[(long)arg] = lwp_self();
+    __atomic_add_fetch(&parked, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&release, __ATOMIC_SEQ_CST)) {
+        lwp_park();
+    }
+    return 0;
+}
+
+// Pages resident and mapped, from /proc/self/statm
+static int read_statm(long *size, long *resident) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    int ok;
+
+    if (f == NULL) {
+        return FALSE;
+    }
+    ok = fscanf(f, "%ld %ld", size, resident) == 2;
+    fclose(f);
+    return ok;
+}
+
+// Starts MEM_THREADS threads that park; reports bytes per LWP, resident
+// and virtual
+static void bench_memory(double *out) {
+    long size0, rss0, size1, rss1, page = sysconf(_SC_PAGESIZE);
+    long i;
+
+    if (!read_statm(&size0, &rss0)) {
+        return;
+    }
+    for (i = 0; i < MEM_THREADS; i++) {
+        lwp_create(parker, (void *)i);
+    }
+    while (__atomic_load_n(&parked, __ATOMIC_SEQ_CST) < MEM_THREADS) {
+        lwp_yield();
+    }
+    if (!read_statm(&size1, &rss1)) {
+        return;
+    }
+    out[0] = (double)(rss1 - rss0) * page / MEM_THREADS;
+    out[1] = (double)(size1 - size0) * page / MEM_THREADS;
+
+    __atomic_store_n(&release, TRUE, __ATOMIC_SEQ_CST);
+    for (i = 0; i < MEM_THREADS; i++) {
+        lwp_unpark(mem_threads[i]);
+    }
+    for (i = 0; i < MEM_THREADS; i++) {
+        lwp_wait(NULL);
+    }
+}
+
+static int computer(void *arg) {
+    long me = (long)arg;
+    volatile long sink = 0;
+    long i, j;
+
+    for (i = 0; i < units[me]; i++) {
+        for (j = 0; j < SPIN_PER_UNIT; j++) {
+            sink += j;
+        }
+        __atomic_store_n(&progress[me], i + 1, __ATOMIC_RELAXED);
+        lwp_yield();
+    }
+    if (!__atomic_exchange_n(&first_done, TRUE, __ATOMIC_ACQ_REL)) {
+        for (i = 0; i < NCOMPUTE; i++) {
+            progress_at_first[i] =
+                __atomic_load_n(&progress[i], __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+}
+
+// Jain's fairness index: (sum x)^2 / (n * sum x^2)
+static double jain(const double *x, int n) {
+    double sum = 0, squares = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        sum += x[i];
+        squares += x[i] * x[i];
+    }
+    return squares == 0 ? 0 : (sum * sum) / (n * squares);
+}
+
+// Runs NCOMPUTE compute threads on NWORKERS workers; reports elapsed
+// ms and the fairness index
+static void bench_sched(double *out) {
+    double start;
+    long i;
+
+    for (i = 0; i < NCOMPUTE; i++) {
+        units[i] = (skewed && i % NWORKERS == 0) ? UNITS * 4 : UNITS;
+        lwp_create_flags(computer, (void *)i, LWP_NOFPU);
+    }
+    start = now_ns();
+    for (i = 0; i < NCOMPUTE; i++) {
+        lwp_wait(NULL);
+    }
+    out[0] = (now_ns() - start) / 1e6;
+    out[1] = jain(progress_at_first, NCOMPUTE);
+}
+
+// Runs one measurement in a fresh process and collects its results
+static void run_child(void (*bench)(double *), int workers, double *out) {
+    int fds[2];
+    pid_t pid;
+
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        memset(out, 0, MAX_RESULTS * sizeof(double));
+        lwp_set_workers(workers);
+        if (bench_scheduler != NULL && bench != bench_next) {
+            lwp_set_scheduler(bench_scheduler);
+        }
+        lwp_start();
+        bench(out);
+        if (write(fds[1], out, MAX_RESULTS * sizeof(double)) < 0) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    if (read(fds[0], out, MAX_RESULTS * sizeof(double)) !=
+        MAX_RESULTS * sizeof(double)) {
+        memset(out, 0, MAX_RESULTS * sizeof(double));
+    }
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+}
+
+static void print_text(void) {
+    int i;
+    for (i = 0; i < nrecords; i++) {
+        printf("%-32s %12.3f %s\n",
+               records[i].name, records[i].value, records[i].unit);
+    }
+}
+
+static void print_csv(void) {
+    int i;
+    printf("name,value,unit\n");
+    for (i = 0; i < nrecords; i++) {
+        printf("%s,%.3f,%s\n",
+               records[i].name, records[i].value, records[i].unit);
+    }
+}
+
+static void print_json(void) {
+    int i;
+    printf("{\n  \"iterations\": %ld,\n  \"results\": [\n", iterations);
+    for (i = 0; i < nrecords; i++) {
+        printf("    {\"name\": \"%s\", \"value\": %.3f, \"unit\": \"%s\"}%s\n",
+               records[i].name, records[i].value, records[i].unit,
+               i + 1 < nrecords ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-f text|csv|json] [iterations]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct {
+        const char *name;
+        scheduler  *sched;
+    } scheds[] = {
+        { "RoundRobin", &RoundRobin },
+        { "Priority", &Priority },
+        { "Stride", &Stride },
+        { "Lottery", &Lottery },
+        { "WorkStealing", &WorkStealing },
+    };
+    static const int sizes[] = { 10, 1000, 100000 };
+    double full[MAX_RESULTS], nofp[MAX_RESULTS];
+    double rr[MAX_RESULTS], ws[MAX_RESULTS], r[MAX_RESULTS];
+    void (*print)(void) = print_text;
+    char name[48];
+    int i, j, opt;
+
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        if (opt != 'f') {
+            usage(argv[0]);
+        } else if (strcmp(optarg, "text") == 0) {
+            print = print_text;
+        } else if (strcmp(optarg, "csv") == 0) {
+            print = print_csv;
+        } else if (strcmp(optarg, "json") == 0) {
+            print = print_json;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc) {
+        iterations = atol(argv[optind]);
+    }
+    if (iterations <= 0) {
+        usage(argv[0]);
+    }
+
+    bench_flags = 0;
+    run_child(bench_yield, 1, full);
+    bench_flags = LWP_NOFPU;
+    run_child(bench_yield, 1, nofp);
+    add_record("yield_fxsave", full[0], "ns/switch");
+    add_record("yield_nofpu", nofp[0], "ns/switch");
+    add_record("yield_nofpu_speedup", full[0] / nofp[0], "x");
+    bench_flags = 0;
+    run_child(bench_roundtrip, 1, r);
+    add_record("yield_roundtrip", r[0], "ns");
+
+    run_child(bench_create, 1, r);
+    add_record("create_wait", r[0], "ns/thread");
+    use_many = TRUE;
+    run_child(bench_create, 1, r);
+    add_record("create_many_wait", r[0], "ns/thread");
+
+    for (i = 0; i < (int)(sizeof(scheds) / sizeof(scheds[0])); i++) {
+        bench_scheduler = *scheds[i].sched;
+        for (j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); j++) {
+            queued = sizes[j];
+            run_child(bench_next, 1, r);
+            snprintf(name, sizeof(name), "next_%s_%d", scheds[i].name,
+                     sizes[j]);
+            add_record(name, r[0], "ns/call");
+            snprintf(name, sizeof(name), "admit_%s_%d", scheds[i].name,
+                     sizes[j]);
+            add_record(name, r[1], "ns/call");
+        }
+    }
+    bench_scheduler = NULL;
+
+    run_child(bench_memory, 1, r);
+    add_record("memory_resident", r[0], "bytes/lwp");
+    add_record("memory_virtual", r[1], "bytes/lwp");
+
+    bench_scheduler = RoundRobin;
+    run_child(bench_sched, NWORKERS, rr);
+    bench_scheduler = WorkStealing;
+    run_child(bench_sched, NWORKERS, ws);
+    add_record("fairness_balanced_RoundRobin", rr[1], "jain");
+    add_record("fairness_balanced_WorkStealing", ws[1], "jain");
+
+    skewed = TRUE;
+    bench_scheduler = RoundRobin;
+    run_child(bench_sched, NWORKERS, rr);
+    bench_scheduler = WorkStealing;
+    run_child(bench_sched, NWORKERS, ws);
+    add_record("skewed_elapsed_RoundRobin", rr[0], "ms");
+    add_record("skewed_elapsed_WorkStealing", ws[0], "ms");
+
+    print();
+    return 0;
+}
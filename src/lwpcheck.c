@@ -0,0 +1,1718 @@
+/*
+ * lwpcheck: self-checks for the LWP library.
+ *
+ * usage: lwpcheck [name ...]
+ *
+ * Runs every check, or only those whose names start with one of the
+ * arguments, and prints "ok" or "FAILED" for each.  The exit status is
+ * 0 if they all passed and 1 otherwise, so "make check" stops on it.
+ *
+ * tid_table: TID_ROUNDS rounds of creating TID_BATCH threads that park
+ *        until told to exit, then letting an uneven third of all those
+ *        still alive go and reaping them.  The tids soon span many times
+ *        the table, so entries collide, and most deletes shift others
+ *        back.  After each round every tid ever handed out must look up
+ *        to its own thread if it is alive and to nothing if it's reaped.
+ *
+ * park:  lwp_unpark() before lwp_park() (the permit), two threads
+ *        taking turns PINGS times by parking and unparking each other,
+ *        and a pthread unparking an LWP PINGS times.
+ *
+ * sched: SCHED_THREADS threads under each scheduler that take turns at
+ *        a counter under an lwp_mutex, yield, and every so often pass
+ *        an lwp_sem around.  Every increment must be counted and every
+ *        thread reaped with its own exit status.
+ *
+ * timer: sleepers spread over the wheel's first two levels (and one on
+ *        the third, so its slot has to cascade) must wake no earlier
+ *        than asked, no more than TIMER_SLACK_MS late, and in deadline
+ *        order; timed waits must time out when nothing comes and not
+ *        when something does.
+ *
+ * io:    two threads lwp_read() the same pipe; one byte each must wake
+ *        them both, and the pipe must still be blocking afterwards.
+ *
+ * outside: a plain pthread posts an lwp_sem POSTS times for LWPs to
+ *        take, yielding and masking preemption in between (which must
+ *        do nothing there), while another LWP keeps its worker busy.
+ *
+ * growable_preempt: LWP_GROWABLE threads that go most of the way
+ *        into their first LWP_GROW_INITIAL and spin there for a while,
+ *        beside one that isn't, with lwp_set_preemption() on.  The
+ *        growable ones must survive, and the other must be preempted.
+ *
+ * stack_adapt: under LWP_STACK_ADAPT, LWP_STACK_ADAPT_MIN shallow
+ *        threads of one function must make its later stacks small and
+ *        growable.  One of those that then goes ADAPT_DEEP KB down must
+ *        grow, and its profile must say about how deep it really went,
+ *        not how much of its stack ended up mapped.
+ *
+ * stack_grow: GROWERS LWP_GROWABLE threads each recurse GROW_DEPTH KB
+ *        down, filling every frame and yielding now and then on the way,
+ *        with preemption on.  All their stacks must grow to fit, and
+ *        every frame must still hold what was put in it on the way back.
+ *
+ * fp:    FP_THREADS threads that never yield run chains of floating
+ *        point arithmetic for SPIN_MS under 1 ms preemption, and must
+ *        get exactly what the same chains gave before they started.
+ *        fp_nofpu adds as many LWP_NOFPU threads running integer chains
+ *        beside them, so switches go both ways between the two kinds.
+ *        On one worker every thread must have started before any of
+ *        them finished, which takes preemption.
+ *
+ * sync:  SYNC_WAITERS threads queue on a held lwp_mutex; unlocking
+ *        must hand it to the first of them (a trylock straight after
+ *        fails, and on one worker they get it in the order they came).
+ *        Then lwp_cond_signal() must wake one waiter and
+ *        lwp_cond_broadcast() all the rest, and an lwp_sem_post() to
+ *        waiters must hand its unit over so that a trywait can't take
+ *        it.
+ *
+ * chan:  CHAN_SENDERS threads push CHAN_ITEMS numbered values each
+ *        through a channel of CHAN_CAP, mixing single sends with
+ *        batches bigger than the channel, to CHAN_RECEIVERS threads
+ *        mixing single and batch receives.  Every value must arrive
+ *        exactly once, each receiver must see each sender's values in
+ *        order, and once the last sender closes the channel the
+ *        receivers must drain it and see it closed.  Preemption is on
+ *        throughout.
+ *
+ * create_many: lwp_create_many() of MANY_THREADS threads, not a
+ *        multiple of its internal batch, must create them all with
+ *        distinct tids that look up to threads running the right
+ *        argument, each exactly once; with args NULL they must all
+ *        get NULL.
+ *
+ * sched_swap: SWAP_THREADS threads from lwp_create_many() (so
+ *        they're admitted in batches) yield SWAP_YIELDS times each while
+ *        the main thread moves them between every scheduler in turn,
+ *        with lwp_set_scheduler() between its own yields.  Each swap
+ *        must keep the run queue's length, whether the schedulers
+ *        involved have batch hooks or not, and every thread must get
+ *        all its turns and be reaped.  One worker only, since the
+ *        scheduler can't be changed with more.
+ *
+ * stats: with lwp_set_stats() on, STATS_THREADS threads each spin
+ *        STATS_SPIN_MS in STATS_YIELDS slices with a yield after each.
+ *        lwp_stats() must then show each of them yielding at least that
+ *        often (and, on one worker, scheduled as often), with about
+ *        that much run time and a stack depth, and the global counters
+ *        must have moved by the spawns, switches and reaps that took.
+ *
+ * trace: TRACE_THREADS threads yield, park and are unparked while
+ *        the tracer runs.  The dump must hold, for each of them, its
+ *        creation, runs and stops, the park, the wakeup and its exit,
+ *        in time order on each worker, and lwptrace (./lwptrace, or
+ *        $LWPTRACE) must turn it into JSON with a track, a run slice
+ *        and an exit for each.
+ *
+ * prio:  under Priority, threads at assorted levels (two of them
+ *        asked for levels out of range, which must be clamped, and one
+ *        raised with lwp_set_priority() before it runs) log each turn
+ *        they get and yield, PRIO_TURNS times.  No thread may run while
+ *        one of a higher level is runnable, and threads at one level
+ *        must take turns.  One worker, since each prioritises only its
+ *        own threads.
+ *
+ * share_stride, share_lottery: threads holding 100, 200 and 300
+ *        tickets, and one given 400 with lwp_set_tickets() before it
+ *        runs, count their turns and yield until SHARE_TURNS have gone
+ *        by between them.  Each one's count must be within SHARE_SLACK
+ *        percent of its share.  One worker, as for prio.
+ *
+ * The _workers checks rerun the one before with NWORKERS workers.
+ * Each runs in its own forked child with CHECK_TIMEOUT seconds to
+ * finish, so a hang or a crash fails that check alone.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "lwpint.h"            /* for the trace file format */
+
+#define NWORKERS       4
+#define CHECK_TIMEOUT  30       /* seconds */
+#define TID_ROUNDS     40
+#define TID_BATCH      100
+#define TID_TOTAL      (TID_ROUNDS * TID_BATCH)
+#define PINGS          10000
+#define SCHED_THREADS  64
+#define SCHED_ROUNDS   200
+#define TIMER_SLEEPERS 64
+#define TIMER_SPREAD   300      /* ms; the first level is 64 */
+#define TIMER_CASCADE  4200     /* ms; past the second level's 4096 */
+#define TIMER_SLACK_MS 20
+#define POSTS          20000
+#define SPIN_MS        200
+#define ADAPT_SHALLOW  4        /* KB */
+#define ADAPT_DEEP     100      /* KB */
+#define GROWERS        8
+#define GROW_DEPTH     200      /* KB */
+#define FP_THREADS     4
+#define FP_CHAIN       1000
+#define SYNC_WAITERS   8
+#define CHAN_CAP       7        /* odd, so batches wrap the ring */
+#define CHAN_SENDERS   4
+#define CHAN_RECEIVERS 3
+#define CHAN_ITEMS     5000
+#define CHAN_BATCH     16
+#define MANY_THREADS   1000
+#define SWAP_THREADS   200
+#define SWAP_YIELDS    50
+#define STATS_THREADS  4
+#define STATS_YIELDS   20
+#define STATS_SPIN_MS  40
+#define TRACE_THREADS  4
+#define PRIO_TURNS     3
+#define SHARE_TURNS    12000
+#define SHARE_SLACK    10       /* percent */
+
+typedef struct check {
+    const char *name;
+    int       (*run)(void);     /* 0 if it passed */
+    scheduler  *sched;          /* NULL for the default */
+    int         workers;
+} check;
+
+static const char *check_name = "";
+
+// Reports why the running check failed; returns 1 for it to pass on
+static int fail(const char *fmt, ...) {
+    va_list ap;
+
+    fprintf(stderr, "    %s: ", check_name);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    return 1;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+// tid_table
+
+static tid_t tid_of[TID_TOTAL];
+static int tid_released[TID_TOTAL];     /* 1: told to go, 2: reaped */
+
+static int holder(void *arg) {
+    long i = (long)arg;
+    while (!__atomic_load_n(&tid_released[i], __ATOMIC_ACQUIRE)) {
+        lwp_park();
+    }
+    return 0;
+}
+
+// Every tid handed out so far must look up to its thread while it's
+// alive and to nothing once it's reaped
+static int tid_sweep(int created) {
+    thread t;
+    int i;
+
+    for (i = 0; i < created; i++) {
+        t = tid2thread(tid_of[i]);
+        if (tid_released[i] == 2 && t != NULL) {
+            return fail("reaped tid %lu still found",
+                        (unsigned long)tid_of[i]);
+        }
+        if (tid_released[i] != 2 && (t == NULL || t->tid != tid_of[i])) {
+            return fail("live tid %lu %s", (unsigned long)tid_of[i],
+                        t == NULL ? "not found" : "found the wrong thread");
+        }
+    }
+    if (tid2thread(tid_of[created - 1] + 1) != NULL) {
+        return fail("a tid not handed out yet was found");
+    }
+    return 0;
+}
+
+// Lets an uneven third of the live holders go (all of them if round is
+// negative), and reaps them
+static int tid_release(int created, int round) {
+    int i, n = 0;
+    tid_t tid;
+
+    for (i = 0; i < created; i++) {
+        if (tid_released[i] == 0 &&
+            (round < 0 || (i * 7919 + round) % 3 == 0)) {
+            thread t = tid2thread(tid_of[i]);
+            __atomic_store_n(&tid_released[i], 1, __ATOMIC_RELEASE);
+            lwp_unpark(t);
+            n++;
+        }
+    }
+    while (n-- > 0) {
+        tid = lwp_wait(NULL);
+        for (i = 0; i < created && tid_of[i] != tid; i++) {
+            ;
+        }
+        if (i == created || tid_released[i] != 1) {
+            return fail("lwp_wait() reaped tid %lu, which wasn't let go",
+                        (unsigned long)tid);
+        }
+        tid_released[i] = 2;
+    }
+    return 0;
+}
+
+static int check_tid_table(void) {
+    int round, i, created = 0;
+
+    for (round = 0; round < TID_ROUNDS; round++) {
+        for (i = 0; i < TID_BATCH; i++, created++) {
+            tid_of[created] = lwp_create(holder, (void *)(long)created);
+            if (tid_of[created] == NO_THREAD) {
+                return fail("lwp_create() failed");
+            }
+        }
+        if (tid_sweep(created) || tid_release(created, round) ||
+            tid_sweep(created)) {
+            return 1;
+        }
+    }
+    if (tid_release(created, -1) || tid_sweep(created)) {
+        return 1;
+    }
+    if (lwp_wait(NULL) != NO_THREAD) {
+        return fail("lwp_wait() found a thread after all were reaped");
+    }
+    return 0;
+}
+
+
+// park
+
+static thread players[2];
+static int turn = 0;
+
+static int player(void *arg) {
+    long me = (long)arg;
+    int i;
+
+    __atomic_store_n(&players[me], lwp_self(), __ATOMIC_RELEASE);
+    while (__atomic_load_n(&players[1 - me], __ATOMIC_ACQUIRE) == NULL) {
+        lwp_yield();
+    }
+    for (i = 0; i < PINGS; i++) {
+        while (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) != me) {
+            lwp_park();
+        }
+        __atomic_store_n(&turn, 1 - me, __ATOMIC_RELEASE);
+        lwp_unpark(players[1 - me]);
+    }
+    return 0;
+}
+
+static thread pinged = NULL;
+static int ping_want = 0, ping_sent = 0;
+
+// A pthread that unparks `pinged` each time it asks for it
+static void *pinger(void *arg) {
+    int i;
+
+    for (i = 1; i <= PINGS; i++) {
+        while (__atomic_load_n(&ping_want, __ATOMIC_ACQUIRE) != i) {
+            sched_yield();
+        }
+        __atomic_store_n(&ping_sent, i, __ATOMIC_RELEASE);
+        lwp_unpark(pinged);
+    }
+    return NULL;
+}
+
+static int check_park(void) {
+    pthread_t pt;
+    double start;
+    int i;
+
+    // A permit makes the next park return at once
+    start = now_ms();
+    lwp_unpark(lwp_self());
+    lwp_park();
+    if (now_ms() - start > 1000) {
+        return fail("lwp_park() after lwp_unpark() blocked");
+    }
+
+    lwp_create(player, (void *)0L);
+    lwp_create(player, (void *)1L);
+    if (lwp_wait(NULL) == NO_THREAD || lwp_wait(NULL) == NO_THREAD) {
+        return fail("lost a player");
+    }
+    if (turn != 0) {
+        return fail("the players didn't take the same number of turns");
+    }
+
+    pinged = lwp_self();
+    if (pthread_create(&pt, NULL, pinger, NULL) != 0) {
+        return fail("pthread_create() failed");
+    }
+    for (i = 1; i <= PINGS; i++) {
+        __atomic_store_n(&ping_want, i, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&ping_sent, __ATOMIC_ACQUIRE) != i) {
+            lwp_park();
+        }
+    }
+    pthread_join(pt, NULL);
+    return 0;
+}
+
+
+// sched
+
+static lwp_mutex sched_lock;
+static lwp_sem sched_sem;
+static long sched_count = 0;
+
+static int counter(void *arg) {
+    long i = (long)arg;
+    int r;
+
+    lwp_set_priority(lwp_gettid(), i % 4);      // its own worker's, so
+    lwp_set_tickets(lwp_gettid(), 1 + i % 8);   // this works on any
+    for (r = 0; r < SCHED_ROUNDS; r++) {
+        lwp_mutex_lock(&sched_lock);
+        sched_count++;
+        lwp_mutex_unlock(&sched_lock);
+        if (r % 16 == (int)(i % 16)) {
+            lwp_sem_post(&sched_sem);
+            lwp_sem_wait(&sched_sem);
+        } else {
+            lwp_yield();
+        }
+    }
+    lwp_exit((int)i);
+    return 0;
+}
+
+static int check_sched(void) {
+    int seen[SCHED_THREADS];
+    int i, status;
+
+    lwp_mutex_init(&sched_lock);
+    lwp_sem_init(&sched_sem, 0);
+    memset(seen, 0, sizeof(seen));
+    for (i = 0; i < SCHED_THREADS; i++) {
+        if (lwp_create(counter, (void *)(long)i) == NO_THREAD) {
+            return fail("lwp_create() failed");
+        }
+    }
+    for (i = 0; i < SCHED_THREADS; i++) {
+        if (lwp_wait(&status) == NO_THREAD) {
+            return fail("only %d threads were reaped", i);
+        }
+        if (status < 0 || status >= SCHED_THREADS || seen[status]++) {
+            return fail("bad exit status %#x", status);
+        }
+    }
+    if (sched_count != (long)SCHED_THREADS * SCHED_ROUNDS) {
+        return fail("counted %ld, not %ld", sched_count,
+                    (long)SCHED_THREADS * SCHED_ROUNDS);
+    }
+    return 0;
+}
+
+
+// timer
+
+static int woke_order = 0;
+static int woke_rank[TIMER_SLEEPERS + 1];
+static double woke_late[TIMER_SLEEPERS + 1];
+
+static long sleep_ms(int i) {
+    return i == TIMER_SLEEPERS ? TIMER_CASCADE : (i * 37) % TIMER_SPREAD;
+}
+
+static int sleeper(void *arg) {
+    long i = (long)arg;
+    double start = now_ms();
+
+    lwp_sleep(sleep_ms(i) * 1000);
+    woke_late[i] = now_ms() - start - sleep_ms(i);
+    woke_rank[i] = __atomic_fetch_add(&woke_order, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static int late_poster(void *arg) {
+    lwp_sleep(10000);
+    lwp_sem_post(arg);
+    return 0;
+}
+
+static int check_timer(void) {
+    lwp_sem sem;
+    double start;
+    int i, j;
+
+    for (i = 0; i <= TIMER_SLEEPERS; i++) {
+        lwp_create(sleeper, (void *)(long)i);
+    }
+
+    // Timed waits, while the sleepers are in the wheel
+    lwp_sem_init(&sem, 0);
+    start = now_ms();
+    if (lwp_sem_timedwait(&sem, 30000) != 0) {
+        return fail("lwp_sem_timedwait() on nothing didn't time out");
+    }
+    if (now_ms() - start < 29) {
+        return fail("lwp_sem_timedwait() timed out after %.1f ms, not 30",
+                    now_ms() - start);
+    }
+    lwp_create(late_poster, &sem);
+    start = now_ms();
+    if (lwp_sem_timedwait(&sem, 1000000) != 1) {
+        return fail("lwp_sem_timedwait() timed out though posted");
+    }
+    if (now_ms() - start > 500) {
+        return fail("posted lwp_sem_timedwait() took %.1f ms",
+                    now_ms() - start);
+    }
+
+    for (i = 0; i <= TIMER_SLEEPERS + 1; i++) {
+        if (lwp_wait(NULL) == NO_THREAD) {
+            return fail("lost a sleeper");
+        }
+    }
+    if (lwp_wait_timeout(NULL, 20000) != NO_THREAD) {
+        return fail("lwp_wait_timeout() found a thread");
+    }
+
+    for (i = 0; i <= TIMER_SLEEPERS; i++) {
+        if (woke_late[i] < -1 || woke_late[i] > TIMER_SLACK_MS) {
+            return fail("a %ld ms sleep took %.1f ms", sleep_ms(i),
+                        sleep_ms(i) + woke_late[i]);
+        }
+        for (j = 0; j <= TIMER_SLEEPERS; j++) {
+            if (sleep_ms(i) + TIMER_SLACK_MS < sleep_ms(j) &&
+                woke_rank[i] > woke_rank[j]) {
+                return fail("a %ld ms sleep woke after a %ld ms one",
+                            sleep_ms(i), sleep_ms(j));
+            }
+        }
+    }
+    return 0;
+}
+
+
+// io
+
+static int pipefd[2];
+static int bytes_read = 0;
+
+static int pipe_reader(void *arg) {
+    char c;
+
+    if (lwp_read(pipefd[0], &c, 1) == 1) {
+        __atomic_add_fetch(&bytes_read, 1, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+static int check_io(void) {
+    if (pipe(pipefd) < 0) {
+        return fail("pipe() failed");
+    }
+    lwp_create(pipe_reader, NULL);
+    lwp_create(pipe_reader, NULL);
+    lwp_sleep(20000);                   // both waiting on it by now
+    if (write(pipefd[1], "xy", 2) != 2) {
+        return fail("write() failed");
+    }
+    if (lwp_wait_timeout(NULL, 1000000) == NO_THREAD ||
+        lwp_wait_timeout(NULL, 1000000) == NO_THREAD) {
+        return fail("a reader never woke");
+    }
+    if (bytes_read != 2) {
+        return fail("read %d bytes, not 2", bytes_read);
+    }
+    if (fcntl(pipefd[0], F_GETFL) & O_NONBLOCK) {
+        return fail("the pipe was left non-blocking");
+    }
+    return 0;
+}
+
+
+
+// outside
+
+static lwp_sem posted;
+static long taken = 0;
+static int outside_id = 0;
+
+static void *poster(void *arg) {
+    int i;
+
+    outside_id = lwp_worker_id();
+    for (i = 0; i < POSTS; i++) {
+        lwp_preempt_disable();
+        lwp_yield();
+        lwp_preempt_enable();
+        lwp_sem_post(&posted);
+    }
+    return NULL;
+}
+
+static int taker(void *arg) {
+    int i;
+
+    for (i = 0; i < POSTS / 4; i++) {
+        lwp_sem_wait(&posted);
+        __atomic_add_fetch(&taken, 1, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+static int busy(void *arg) {
+    while (__atomic_load_n(&taken, __ATOMIC_SEQ_CST) < POSTS) {
+        lwp_yield();
+    }
+    return 0;
+}
+
+static int check_outside(void) {
+    pthread_t pt;
+    int i;
+
+    lwp_sem_init(&posted, 0);
+    for (i = 0; i < 4; i++) {
+        lwp_create(taker, NULL);
+    }
+    lwp_create(busy, NULL);
+    if (pthread_create(&pt, NULL, poster, NULL) != 0) {
+        return fail("pthread_create() failed");
+    }
+    for (i = 0; i < 5; i++) {
+        if (lwp_wait(NULL) == NO_THREAD) {
+            return fail("only %ld of %d posts were taken", taken, POSTS);
+        }
+    }
+    pthread_join(pt, NULL);
+    if (outside_id != -1) {
+        return fail("lwp_worker_id() was %d outside the workers",
+                    outside_id);
+    }
+    return 0;
+}
+
+
+// growable_preempt
+
+static volatile long spun = 0;
+static int marked = 0, hog_interrupted = FALSE;
+
+// Recurses about depth KB down and spins there until SPIN_MS are up
+static int dig(int depth, double until) {
+    volatile char frame[1000];
+
+    frame[0] = (char)depth;
+    if (depth > 0) {
+        return dig(depth - 1, until) + frame[0];
+    }
+    while (now_ms() < until) {
+        spun++;
+    }
+    return frame[0];
+}
+
+static int digger(void *arg) {
+    return dig((int)(long)arg, now_ms() + SPIN_MS) & 0;
+}
+
+// Never yields, so only preemption lets anything else run
+static int hog(void *arg) {
+    double until = now_ms() + SPIN_MS;
+
+    while (now_ms() < until) {
+        if (__atomic_load_n(&marked, __ATOMIC_SEQ_CST)) {
+            hog_interrupted = TRUE;
+            break;
+        }
+    }
+    return 0;
+}
+
+static int marker(void *arg) {
+    __atomic_store_n(&marked, TRUE, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static int check_growable_preempt(void) {
+    lwp_attr attr;
+    int i;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.flags = LWP_GROWABLE;
+    lwp_set_preemption(1000);
+    for (i = 0; i < 2; i++) {
+        lwp_create_ex(digger, (void *)(long)(12 + 2 * i), &attr);
+    }
+    lwp_create(hog, NULL);
+    lwp_create(marker, NULL);
+    for (i = 0; i < 4; i++) {
+        if (lwp_wait(NULL) == NO_THREAD) {
+            return fail("lost a thread");
+        }
+    }
+    if (!hog_interrupted) {
+        return fail("the thread that never yields wasn't preempted");
+    }
+    return 0;
+}
+
+
+// stack_adapt
+
+// Recurses about depth KB down
+static int descend(int depth) {
+    volatile char frame[1000];
+
+    frame[0] = (char)depth;
+    if (depth > 0) {
+        return descend(depth - 1) + frame[0];
+    }
+    return frame[0];
+}
+
+static int adapted(void *arg) {
+    return descend((int)(long)arg) & 0;
+}
+
+// Finds adapted()'s profile; FALSE if it has none
+static int adapted_profile(lwp_stackprofile *out) {
+    static lwp_stackprofile all[256];
+    int i, n = lwp_stack_profiles(all, sizeof(all) / sizeof(all[0]));
+
+    for (i = 0; i < n; i++) {
+        if (all[i].function == adapted) {
+            *out = all[i];
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static int check_stack_adapt(void) {
+    lwp_stackprofile prof;
+    int i, status;
+    thread t;
+
+    lwp_set_stack_policy(LWP_STACK_ADAPT);
+    for (i = 0; i < LWP_STACK_ADAPT_MIN; i++) {
+        lwp_create(adapted, (void *)(long)ADAPT_SHALLOW);
+        lwp_wait(NULL);
+    }
+    if (!adapted_profile(&prof) || prof.threads != LWP_STACK_ADAPT_MIN) {
+        return fail("the shallow threads weren't all profiled");
+    }
+    if (prof.size >= ADAPT_DEEP * 1024) {
+        return fail("adapted to %lu bytes after peaks of %lu",
+                    (unsigned long)prof.size, (unsigned long)prof.peak);
+    }
+
+    t = tid2thread(lwp_create(adapted, (void *)(long)ADAPT_DEEP));
+    if (t == NULL || t->stack_mapped == 0) {
+        return fail("the adapted stack isn't growable");
+    }
+    if (lwp_wait(&status) == NO_THREAD || status != 0) {
+        return fail("the deep thread didn't come back");
+    }
+    if (!adapted_profile(&prof) || prof.overflowed) {
+        return fail("the deep thread's profile was lost");
+    }
+    if (prof.peak < ADAPT_DEEP * 1000 || prof.peak > ADAPT_DEEP * 1100) {
+        return fail("recorded a peak of %lu bytes for about %d KB",
+                    (unsigned long)prof.peak, ADAPT_DEEP);
+    }
+    return 0;
+}
+
+
+// stack_grow
+
+static size_t grown_to[GROWERS];
+
+// Recurses about depth KB down, yielding every 16, and returns how many
+// of its frames didn't keep their contents
+static int grow_down(int depth, int i) {
+    volatile char frame[1000];
+    int bad = 0, j;
+
+    for (j = 0; j < (int)sizeof(frame); j++) {
+        frame[j] = (char)(depth + i);
+    }
+    if (depth % 16 == 0) {
+        lwp_yield();
+    }
+    if (depth > 0) {
+        bad = grow_down(depth - 1, i);
+    } else {
+        grown_to[i] = lwp_self()->stack_mapped;
+    }
+    for (j = 0; j < (int)sizeof(frame); j++) {
+        if (frame[j] != (char)(depth + i)) {
+            return bad + 1;
+        }
+    }
+    return bad;
+}
+
+static int grower(void *arg) {
+    return grow_down(GROW_DEPTH, (int)(long)arg);
+}
+
+static int check_stack_grow(void) {
+    lwp_attr attr;
+    int i, status;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.flags = LWP_GROWABLE;
+    lwp_set_preemption(1000);
+    for (i = 0; i < GROWERS; i++) {
+        lwp_create_ex(grower, (void *)(long)i, &attr);
+    }
+    for (i = 0; i < GROWERS; i++) {
+        if (lwp_wait(&status) == NO_THREAD) {
+            return fail("lost a thread");
+        }
+        if (status != 0) {
+            return fail("%d frames were overwritten", status);
+        }
+    }
+    for (i = 0; i < GROWERS; i++) {
+        if (grown_to[i] < GROW_DEPTH * 1000) {
+            return fail("stack %d has %lu bytes mapped at %d KB down", i,
+                        (unsigned long)grown_to[i], GROW_DEPTH);
+        }
+    }
+    return 0;
+}
+
+
+// fp
+
+static double fp_expect[FP_THREADS];
+static unsigned long int_expect[FP_THREADS];
+static int fp_started = 0, fp_total = 0, fp_running = 0;
+
+// These are noinline so that every thread, and the reference run, gets
+// exactly the same code
+static __attribute__((noinline)) double fp_chain(double c) {
+    double x = 1.0;
+    int i;
+
+    for (i = 0; i < FP_CHAIN; i++) {
+        x = x * 0.999999 + c;
+    }
+    return x;
+}
+
+static __attribute__((noinline)) unsigned long int_chain(unsigned long x) {
+    int i;
+
+    for (i = 0; i < FP_CHAIN; i++) {
+        x = x * 6364136223846793005UL + 1442695040888963407UL;
+    }
+    return x;
+}
+
+// Whether every fp thread had started by the time this one finished,
+// which it can't have on one worker without being preempted
+static int all_started(void) {
+    return __atomic_load_n(&fp_started, __ATOMIC_SEQ_CST) == fp_total;
+}
+
+static int fp_spinner(void *arg) {
+    long i = (long)arg;
+    double until, sum = 0.0, want = 0.0;
+    long rounds = 0, r;
+
+    __atomic_add_fetch(&fp_started, 1, __ATOMIC_SEQ_CST);
+    until = now_ms() + SPIN_MS;
+    while (now_ms() < until) {
+        double x = fp_chain(0.5 + i);
+        if (x != fp_expect[i]) {
+            break;
+        }
+        sum += x;
+        rounds++;
+    }
+    for (r = 0; r < rounds; r++) {
+        want += fp_expect[i];
+    }
+    __atomic_sub_fetch(&fp_running, 1, __ATOMIC_SEQ_CST);
+    if (now_ms() < until || sum != want) {
+        return 1;
+    }
+    return all_started() ? 0 : 2;
+}
+
+// Integer work only, so it can be LWP_NOFPU; runs until the fp ones stop
+static int int_spinner(void *arg) {
+    long i = (long)arg;
+
+    __atomic_add_fetch(&fp_started, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&fp_running, __ATOMIC_SEQ_CST) > 0) {
+        if (int_chain(i + 1) != int_expect[i]) {
+            return 1;
+        }
+    }
+    return all_started() ? 0 : 2;
+}
+
+static int fp_run(int nofpu) {
+    int i, status;
+
+    for (i = 0; i < FP_THREADS; i++) {
+        fp_expect[i] = fp_chain(0.5 + i);
+        int_expect[i] = int_chain(i + 1);
+    }
+    fp_total = nofpu ? 2 * FP_THREADS : FP_THREADS;
+    fp_running = FP_THREADS;
+    lwp_set_preemption(1000);
+    for (i = 0; i < FP_THREADS; i++) {
+        lwp_create(fp_spinner, (void *)(long)i);
+        if (nofpu) {
+            lwp_create_flags(int_spinner, (void *)(long)i, LWP_NOFPU);
+        }
+    }
+    for (i = 0; i < fp_total; i++) {
+        if (lwp_wait(&status) == NO_THREAD) {
+            return fail("lost a thread");
+        }
+        if (status == 1) {
+            return fail("a chain came out different under preemption");
+        }
+        if (status == 2) {
+            return fail("a thread that never yields wasn't preempted");
+        }
+    }
+    return 0;
+}
+
+static int check_fp(void) {
+    return fp_run(FALSE);
+}
+
+static int check_fp_nofpu(void) {
+    return fp_run(TRUE);
+}
+
+
+// sync
+
+static lwp_mutex sync_lock;
+static lwp_cond sync_cond;
+static lwp_sem sync_sem;
+static int sync_order[SYNC_WAITERS], sync_next = 0;
+static int cond_waiting = 0, cond_woken = 0, cond_gen = 0;
+static int sem_taken = 0;
+
+static int lock_waiter(void *arg) {
+    lwp_mutex_lock(&sync_lock);
+    sync_order[sync_next++] = (int)(long)arg;
+    lwp_sleep(1000);                    // so it stays held past the trylock
+    lwp_mutex_unlock(&sync_lock);
+    return 0;
+}
+
+static int cond_waiter(void *arg) {
+    int gen;
+
+    lwp_mutex_lock(&sync_lock);
+    gen = cond_gen;
+    cond_waiting++;
+    while (cond_gen == gen) {
+        lwp_cond_wait(&sync_cond, &sync_lock);
+    }
+    cond_woken++;
+    lwp_mutex_unlock(&sync_lock);
+    return 0;
+}
+
+static int sem_waiter(void *arg) {
+    lwp_sem_wait(&sync_sem);
+    __atomic_add_fetch(&sem_taken, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+// Reaps n threads; FALSE if they don't all finish within a second each
+static int reap_all(int n) {
+    while (n-- > 0) {
+        if (lwp_wait_timeout(NULL, 1000000) == NO_THREAD) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static int check_sync(void) {
+    int i, woken;
+
+    lwp_mutex_init(&sync_lock);
+    lwp_cond_init(&sync_cond);
+    lwp_sem_init(&sync_sem, 0);
+
+    lwp_mutex_lock(&sync_lock);
+    for (i = 0; i < SYNC_WAITERS; i++) {
+        lwp_create(lock_waiter, (void *)(long)i);
+    }
+    lwp_sleep(20000);                   // all queued on it by now
+    lwp_mutex_unlock(&sync_lock);
+    if (lwp_mutex_trylock(&sync_lock)) {
+        return fail("the mutex was free after an unlock with waiters");
+    }
+    if (!reap_all(SYNC_WAITERS) || sync_next != SYNC_WAITERS) {
+        return fail("only %d of %d lockers got the mutex", sync_next,
+                    SYNC_WAITERS);
+    }
+    for (i = 0; lwp_get_workers() == 1 && i < SYNC_WAITERS; i++) {
+        if (sync_order[i] != i) {
+            return fail("locker %d got the mutex %dth", sync_order[i], i);
+        }
+    }
+
+    for (i = 0; i < SYNC_WAITERS; i++) {
+        lwp_create(cond_waiter, NULL);
+    }
+    lwp_sleep(20000);
+    lwp_mutex_lock(&sync_lock);
+    if (cond_waiting != SYNC_WAITERS) {
+        return fail("only %d condvar waiters got going", cond_waiting);
+    }
+    cond_gen++;
+    lwp_cond_signal(&sync_cond);
+    lwp_mutex_unlock(&sync_lock);
+    lwp_sleep(20000);
+    lwp_mutex_lock(&sync_lock);
+    woken = cond_woken;
+    lwp_cond_broadcast(&sync_cond);
+    lwp_mutex_unlock(&sync_lock);
+    if (woken != 1) {
+        return fail("lwp_cond_signal() woke %d waiters", woken);
+    }
+    if (!reap_all(SYNC_WAITERS)) {
+        return fail("lwp_cond_broadcast() left %d waiting",
+                    SYNC_WAITERS - cond_woken);
+    }
+
+    for (i = 0; i < SYNC_WAITERS; i++) {
+        lwp_create(sem_waiter, NULL);
+    }
+    lwp_sleep(20000);
+    for (i = 0; i < SYNC_WAITERS; i++) {
+        lwp_sem_post(&sync_sem);
+        if (lwp_sem_trywait(&sync_sem)) {
+            return fail("took a unit that was posted to a waiter");
+        }
+    }
+    if (!reap_all(SYNC_WAITERS) || sem_taken != SYNC_WAITERS) {
+        return fail("only %d of %d sem waiters got a unit", sem_taken,
+                    SYNC_WAITERS);
+    }
+    return 0;
+}
+
+
+// chan
+
+static lwp_chan *chan;
+static int chan_senders_left;
+static unsigned char chan_seen[CHAN_SENDERS][CHAN_ITEMS];
+
+static int chan_sender(void *arg) {
+    long s = (long)arg;
+    int vals[CHAN_BATCH];
+    int seq = 0, n, i;
+
+    while (seq < CHAN_ITEMS) {
+        n = 1 + (seq + (int)s) % CHAN_BATCH;
+        if (n > CHAN_ITEMS - seq) {
+            n = CHAN_ITEMS - seq;
+        }
+        for (i = 0; i < n; i++) {
+            vals[i] = (int)(s << 16 | (seq + i));
+        }
+        if (n == 1 ? lwp_chan_send(chan, vals) != 0
+                   : lwp_chan_send_batch(chan, vals, n) != n) {
+            return 3;
+        }
+        seq += n;
+    }
+    if (__atomic_sub_fetch(&chan_senders_left, 1, __ATOMIC_SEQ_CST) == 0) {
+        lwp_chan_close(chan);
+    }
+    return 0;
+}
+
+// Returns 0, 1 if a value was seen twice, or 2 if one came out of order
+static int chan_receiver(void *arg) {
+    int last[CHAN_SENDERS], vals[CHAN_BATCH];
+    int n, i, s, seq, turn = 0;
+
+    for (i = 0; i < CHAN_SENDERS; i++) {
+        last[i] = -1;
+    }
+    for (;;) {
+        if (turn++ % 2) {
+            n = lwp_chan_recv(chan, vals) == 0 ? 1 : 0;
+        } else {
+            n = lwp_chan_recv_batch(chan, vals, 1 + turn % CHAN_BATCH);
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        for (i = 0; i < n; i++) {
+            s = vals[i] >> 16;
+            seq = vals[i] & 0xffff;
+            if (__atomic_exchange_n(&chan_seen[s][seq], 1,
+                                    __ATOMIC_SEQ_CST)) {
+                return 1;
+            }
+            if (seq <= last[s]) {
+                return 2;
+            }
+            last[s] = seq;
+        }
+    }
+}
+
+static int check_chan(void) {
+    int i, s, status, v = 0;
+
+    lwp_set_preemption(1000);
+    chan = LWP_CHAN(int, CHAN_CAP);
+    if (chan == NULL) {
+        return fail("lwp_chan_create() failed");
+    }
+    if (lwp_chan_recv_timeout(chan, &v, 10000) != LWP_TIMEOUT) {
+        return fail("a receive from an empty channel didn't time out");
+    }
+    chan_senders_left = CHAN_SENDERS;
+    for (i = 0; i < CHAN_RECEIVERS; i++) {
+        lwp_create(chan_receiver, NULL);
+    }
+    for (i = 0; i < CHAN_SENDERS; i++) {
+        lwp_create(chan_sender, (void *)(long)i);
+    }
+    for (i = 0; i < CHAN_SENDERS + CHAN_RECEIVERS; i++) {
+        if (lwp_wait(&status) == NO_THREAD) {
+            return fail("lost a thread");
+        }
+        if (status == 1) {
+            return fail("a value was received twice");
+        }
+        if (status == 2) {
+            return fail("a sender's values arrived out of order");
+        }
+        if (status == 3) {
+            return fail("a send failed before the channel was closed");
+        }
+    }
+    for (s = 0; s < CHAN_SENDERS; s++) {
+        for (i = 0; i < CHAN_ITEMS; i++) {
+            if (!chan_seen[s][i]) {
+                return fail("sender %d's value %d never arrived", s, i);
+            }
+        }
+    }
+    if (lwp_chan_send(chan, &v) != -1 || lwp_chan_recv(chan, &v) != -1) {
+        return fail("the closed channel still worked");
+    }
+    lwp_chan_destroy(chan);
+    return 0;
+}
+
+
+// create_many
+
+static int many_ran[MANY_THREADS + 1];  /* the last: NULL arguments */
+
+static int many_thread(void *arg) {
+    long i = arg == NULL ? MANY_THREADS : (long)arg - 1;
+
+    __atomic_add_fetch(&many_ran[i], 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static int check_create_many(void) {
+    static void *args[MANY_THREADS];
+    static tid_t tids[MANY_THREADS];
+    thread t;
+    int i, j, n;
+
+    for (i = 0; i < MANY_THREADS; i++) {
+        args[i] = (void *)(long)(i + 1);
+    }
+    n = lwp_create_many(many_thread, args, MANY_THREADS, tids);
+    if (n != MANY_THREADS) {
+        return fail("created %d of %d threads", n, MANY_THREADS);
+    }
+    for (i = 0; i < MANY_THREADS; i++) {
+        t = tid2thread(tids[i]);
+        if (t == NULL || t->tid != tids[i]) {
+            return fail("tid %lu doesn't look up", (unsigned long)tids[i]);
+        }
+        for (j = 0; j < i; j++) {
+            if (tids[j] == tids[i]) {
+                return fail("tid %lu handed out twice",
+                            (unsigned long)tids[i]);
+            }
+        }
+    }
+    if (lwp_create_many(many_thread, NULL, 10, NULL) != 10) {
+        return fail("couldn't create threads without arguments");
+    }
+    for (i = 0; i < MANY_THREADS + 10; i++) {
+        if (lwp_wait(NULL) == NO_THREAD) {
+            return fail("only reaped %d threads", i);
+        }
+    }
+    for (i = 0; i < MANY_THREADS; i++) {
+        if (many_ran[i] != 1) {
+            return fail("thread %d ran %d times", i, many_ran[i]);
+        }
+    }
+    if (many_ran[MANY_THREADS] != 10) {
+        return fail("%d threads got NULL, not 10", many_ran[MANY_THREADS]);
+    }
+    return 0;
+}
+
+
+// sched_swap
+
+static int swap_turns[SWAP_THREADS];
+
+static int swapped(void *arg) {
+    long i = (long)arg;
+    int n;
+
+    for (n = 0; n < SWAP_YIELDS; n++) {
+        swap_turns[i]++;
+        lwp_yield();
+    }
+    return 0;
+}
+
+static int check_sched_swap(void) {
+    static scheduler *order[] = {
+        &Priority, &Lottery, &Stride, &WorkStealing, &RoundRobin,
+        &Lottery, &Priority, &RoundRobin, &Stride, &WorkStealing,
+    };
+    static void *args[SWAP_THREADS];
+    scheduler next;
+    int i, before, after, swaps = 0, reaped = 0;
+
+    for (i = 0; i < SWAP_THREADS; i++) {
+        args[i] = (void *)(long)i;
+    }
+    if (lwp_create_many(swapped, args, SWAP_THREADS, NULL) != SWAP_THREADS) {
+        return fail("lwp_create_many() fell short");
+    }
+    while (reaped < SWAP_THREADS) {
+        next = *order[swaps++ % (sizeof(order) / sizeof(order[0]))];
+        before = lwp_get_scheduler()->qlen();
+        lwp_set_scheduler(next);
+        after = lwp_get_scheduler()->qlen();
+        if (lwp_get_scheduler() != next) {
+            return fail("lwp_set_scheduler() didn't take");
+        }
+        if (after != before) {
+            return fail("swap %d left %d of %d queued threads", swaps,
+                        after, before);
+        }
+        lwp_yield();
+        while (lwp_wait_timeout(NULL, 0) != NO_THREAD) {
+            reaped++;
+        }
+        if (swaps > SWAP_THREADS * SWAP_YIELDS) {
+            return fail("reaped only %d threads", reaped);
+        }
+    }
+    for (i = 0; i < SWAP_THREADS; i++) {
+        if (swap_turns[i] != SWAP_YIELDS) {
+            return fail("thread %d had %d turns", i, swap_turns[i]);
+        }
+    }
+    return 0;
+}
+
+
+// stats
+
+static int stats_done = 0, stats_release = FALSE;
+
+static int stats_thread(void *arg) {
+    double until;
+    int i;
+
+    for (i = 0; i < STATS_YIELDS; i++) {
+        until = now_ms() + (double)STATS_SPIN_MS / STATS_YIELDS;
+        while (now_ms() < until) {
+            spun++;
+        }
+        lwp_yield();
+    }
+    __atomic_add_fetch(&stats_done, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&stats_release, __ATOMIC_SEQ_CST)) {
+        lwp_park();
+    }
+    return 0;
+}
+
+static int check_stats(void) {
+    lwp_counters before, during, after;
+    lwp_threadstats ts[STATS_THREADS + 8];
+    tid_t tids[STATS_THREADS];
+    int i, j, n, alone = lwp_get_workers() == 1;
+
+    lwp_set_stats(TRUE);
+    lwp_stats(&before, ts, 0);
+    for (i = 0; i < STATS_THREADS; i++) {
+        tids[i] = lwp_create(stats_thread, NULL);
+    }
+    while (__atomic_load_n(&stats_done, __ATOMIC_SEQ_CST) < STATS_THREADS) {
+        lwp_yield();
+    }
+    n = lwp_stats(&during, ts, STATS_THREADS + 8);
+    for (i = 0; i < STATS_THREADS; i++) {
+        for (j = 0; j < n && ts[j].tid != tids[i]; j++) {
+        }
+        if (j == n) {
+            return fail("tid %lu isn't in the stats", (unsigned long)tids[i]);
+        }
+        // With a worker to itself, a yield needn't switch at all
+        if (ts[j].yields < STATS_YIELDS ||
+            ts[j].scheduled < (alone ? STATS_YIELDS : 1)) {
+            return fail("%lu yields and %lu runs counted, for %d of each",
+                        ts[j].yields, ts[j].scheduled, STATS_YIELDS);
+        }
+        if (ts[j].run_ns < STATS_SPIN_MS * 1000000ULL / 2) {
+            return fail("%llu ns run time counted for %d ms",
+                        ts[j].run_ns, STATS_SPIN_MS);
+        }
+        if (ts[j].stack_peak == 0) {
+            return fail("no stack depth recorded");
+        }
+    }
+    if (during.spawns - before.spawns != STATS_THREADS ||
+        during.nthreads - before.nthreads != STATS_THREADS) {
+        return fail("%lu spawns and %d more threads counted, for %d",
+                    during.spawns - before.spawns,
+                    during.nthreads - before.nthreads, STATS_THREADS);
+    }
+    if (during.switches - before.switches <
+        (alone ? STATS_THREADS * STATS_YIELDS : STATS_THREADS)) {
+        return fail("only %lu switches counted",
+                    during.switches - before.switches);
+    }
+    if (during.runq_peak < 1) {
+        return fail("the run queue never had anything on it");
+    }
+
+    __atomic_store_n(&stats_release, TRUE, __ATOMIC_SEQ_CST);
+    for (i = 0; i < STATS_THREADS; i++) {
+        lwp_unpark(tid2thread(tids[i]));
+    }
+    for (i = 0; i < STATS_THREADS; i++) {
+        lwp_wait(NULL);
+    }
+    lwp_stats(&after, ts, 0);
+    if (after.reaps - during.reaps != STATS_THREADS ||
+        after.nthreads != before.nthreads) {
+        return fail("%lu reaps counted, for %d",
+                    after.reaps - during.reaps, STATS_THREADS);
+    }
+    return 0;
+}
+
+
+// trace
+
+static int trace_release = FALSE;
+
+static int traced(void *arg) {
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        lwp_yield();
+    }
+    while (!__atomic_load_n(&trace_release, __ATOMIC_SEQ_CST)) {
+        lwp_park();
+    }
+    return 0;
+}
+
+// Checks the dump in path for tids' events; returns 0 or fail()'s 1
+static int trace_read(const char *path, const tid_t tids[]) {
+    int want = 1 << TRACE_CREATE | 1 << TRACE_RUN | 1 << TRACE_STOP |
+               1 << TRACE_BLOCK | 1 << TRACE_WAKE | 1 << TRACE_EXIT;
+    unsigned long long last_tsc[NWORKERS + 1] = { 0 };
+    int seen[TRACE_THREADS] = { 0 };
+    trace_header h;
+    trace_event e;
+    unsigned long n;
+    FILE *f;
+    int i;
+
+    f = fopen(path, "rb");
+    if (f == NULL || fread(&h, sizeof(h), 1, f) != 1 ||
+        memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0) {
+        return fail("the dump has no trace header");
+    }
+    for (n = 0; fread(&e, sizeof(e), 1, f) == 1; n++) {
+        if (e.worker < 0 || e.worker > NWORKERS) {
+            continue;
+        }
+        if (e.tsc < last_tsc[e.worker]) {
+            return fail("event %lu on worker %d is out of order", n,
+                        e.worker);
+        }
+        last_tsc[e.worker] = e.tsc;
+        for (i = 0; i < TRACE_THREADS; i++) {
+            if (e.tid == tids[i]) {
+                seen[i] |= 1 << e.type;
+            }
+        }
+    }
+    fclose(f);
+    if (n != h.count) {
+        return fail("the header says %lu events, the file has %lu",
+                    h.count, n);
+    }
+    for (i = 0; i < TRACE_THREADS; i++) {
+        if (seen[i] != want) {
+            return fail("tid %lu's events were %#x, not %#x",
+                        (unsigned long)tids[i], seen[i], want);
+        }
+    }
+    return 0;
+}
+
+// Runs lwptrace on path and checks its JSON for tids' tracks
+static int trace_convert(const char *path, const tid_t tids[]) {
+    const char *tool = getenv("LWPTRACE");
+    char cmd[256], pat[128], *json = NULL, *grown;
+    size_t len = 0, got;
+    FILE *p;
+    int i;
+
+    snprintf(cmd, sizeof(cmd), "%s %s", tool ? tool : "./lwptrace", path);
+    p = popen(cmd, "r");
+    if (p == NULL) {
+        return fail("can't run %s", cmd);
+    }
+    do {
+        grown = realloc(json, len + 4097);
+        if (grown == NULL) {
+            free(json);
+            pclose(p);
+            return fail("out of memory reading the JSON");
+        }
+        json = grown;
+        got = fread(json + len, 1, 4096, p);
+        len += got;
+    } while (got > 0);
+    json[len] = '\0';
+    if (pclose(p) != 0 || strncmp(json, "{\"displayTimeUnit\"", 18) != 0 ||
+        strstr(json, "\n]}\n") == NULL) {
+        free(json);
+        return fail("%s didn't produce a trace", cmd);
+    }
+    for (i = 0; i < TRACE_THREADS; i++) {
+        unsigned long tid = (unsigned long)tids[i];
+        snprintf(pat, sizeof(pat), "\"name\": \"lwp %lu\"", tid);
+        if (strstr(json, pat) == NULL) {
+            break;
+        }
+        snprintf(pat, sizeof(pat), "\"ph\": \"X\", \"pid\": 1, "
+                 "\"tid\": %lu,", tid);
+        if (strstr(json, pat) == NULL) {
+            break;
+        }
+        snprintf(pat, sizeof(pat), "\"name\": \"exit\", \"ph\": \"i\", "
+                 "\"s\": \"t\", \"pid\": 1, \"tid\": %lu,", tid);
+        if (strstr(json, pat) == NULL) {
+            break;
+        }
+    }
+    free(json);
+    if (i < TRACE_THREADS) {
+        return fail("lwp %lu is missing from the JSON",
+                    (unsigned long)tids[i]);
+    }
+    return 0;
+}
+
+static int check_trace(void) {
+    char path[] = "/tmp/lwpcheck.XXXXXX";
+    tid_t tids[TRACE_THREADS];
+    int i, fd, bad;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        return fail("mkstemp() failed");
+    }
+    close(fd);
+    if (lwp_trace_start(0) != 0) {
+        return fail("lwp_trace_start() failed");
+    }
+    for (i = 0; i < TRACE_THREADS; i++) {
+        tids[i] = lwp_create(traced, NULL);
+    }
+    lwp_sleep(20000);                   // all parked by now
+    __atomic_store_n(&trace_release, TRUE, __ATOMIC_SEQ_CST);
+    for (i = 0; i < TRACE_THREADS; i++) {
+        lwp_unpark(tid2thread(tids[i]));
+    }
+    for (i = 0; i < TRACE_THREADS; i++) {
+        lwp_wait(NULL);
+    }
+    lwp_trace_stop();
+    if (lwp_trace_dump(path) != 0) {
+        unlink(path);
+        return fail("lwp_trace_dump() failed");
+    }
+    bad = trace_read(path, tids) || trace_convert(path, tids);
+    unlink(path);
+    return bad;
+}
+
+
+// prio
+
+static const int prio_asked[] = { 5, 40, 5, 63, 0, 40, 20, 100, -3, 1 };
+static const int prio_level[] = { 5, 40, 5, 63, 0, 40, 20, 63, 0, 62 };
+#define PRIO_THREADS ((int)(sizeof(prio_asked) / sizeof(prio_asked[0])))
+#define PRIO_RAISED  9
+
+static int prio_log[PRIO_THREADS * PRIO_TURNS], prio_logged = 0;
+
+static int prio_thread(void *arg) {
+    int i;
+
+    for (i = 0; i < PRIO_TURNS; i++) {
+        prio_log[prio_logged++] = (int)(long)arg;
+        lwp_yield();
+    }
+    return 0;
+}
+
+static int check_prio(void) {
+    tid_t tids[PRIO_THREADS];
+    int at_level[LWP_PRIO_LEVELS] = { 0 };
+    lwp_attr attr;
+    int i, j, level, n;
+
+    memset(&attr, 0, sizeof(attr));
+    for (i = 0; i < PRIO_THREADS; i++) {
+        attr.prio = prio_asked[i];
+        tids[i] = lwp_create_ex(prio_thread, (void *)(long)i, &attr);
+        at_level[prio_level[i]]++;
+    }
+    if (lwp_get_priority(tids[7]) != LWP_PRIO_LEVELS - 1 ||
+        lwp_get_priority(tids[8]) != 0) {
+        return fail("priorities %d and %d came out as %d and %d",
+                    prio_asked[7], prio_asked[8],
+                    lwp_get_priority(tids[7]), lwp_get_priority(tids[8]));
+    }
+    lwp_set_priority(tids[PRIO_RAISED], prio_level[PRIO_RAISED]);
+    for (i = 0; i < PRIO_THREADS; i++) {
+        lwp_wait(NULL);
+    }
+    if (prio_logged != PRIO_THREADS * PRIO_TURNS) {
+        return fail("%d turns logged", prio_logged);
+    }
+    for (i = 1; i < prio_logged; i++) {
+        if (prio_level[prio_log[i]] > prio_level[prio_log[i - 1]]) {
+            return fail("level %d ran with level %d waiting",
+                        prio_level[prio_log[i - 1]], prio_level[prio_log[i]]);
+        }
+    }
+    // The threads at each level go round in the same order every time
+    for (i = 0; i < prio_logged; i += n) {
+        level = prio_level[prio_log[i]];
+        n = at_level[level];
+        for (j = i + n; j < i + n * PRIO_TURNS; j++) {
+            if (prio_log[j] != prio_log[j - n]) {
+                return fail("level %d's threads didn't take turns", level);
+            }
+        }
+        i += n * (PRIO_TURNS - 1);
+    }
+    return 0;
+}
+
+
+// share
+
+static const int share_tickets[] = { 100, 200, 300, 400 };
+#define SHARE_THREADS ((int)(sizeof(share_tickets) / sizeof(share_tickets[0])))
+
+static long share_turns[SHARE_THREADS], share_total = 0;
+
+static int share_thread(void *arg) {
+    long i = (long)arg;
+
+    while (share_total < SHARE_TURNS) {
+        share_turns[i]++;
+        share_total++;
+        lwp_yield();
+    }
+    return 0;
+}
+
+static int check_share(void) {
+    tid_t last = NO_THREAD;
+    lwp_attr attr;
+    long all = 0, want;
+    int i;
+
+    memset(&attr, 0, sizeof(attr));
+    for (i = 0; i < SHARE_THREADS; i++) {
+        all += share_tickets[i];
+        attr.tickets = i < SHARE_THREADS - 1 ? share_tickets[i] : 100;
+        last = lwp_create_ex(share_thread, (void *)(long)i, &attr);
+    }
+    lwp_set_tickets(last, share_tickets[SHARE_THREADS - 1]);
+    for (i = 0; i < SHARE_THREADS; i++) {
+        lwp_wait(NULL);
+    }
+    for (i = 0; i < SHARE_THREADS; i++) {
+        want = share_total * share_tickets[i] / all;
+        if (labs(share_turns[i] - want) * 100 > want * SHARE_SLACK) {
+            return fail("%d tickets got %ld of %ld turns, not about %ld",
+                        share_tickets[i], share_turns[i], share_total,
+                        want);
+        }
+    }
+    return 0;
+}
+
+static const check checks[] = {
+    { "tid_table",                  check_tid_table, NULL,          1 },
+    { "park",                       check_park,      NULL,          1 },
+    { "park_workers",               check_park,      NULL,          NWORKERS },
+    { "sched_roundrobin",           check_sched,     &RoundRobin,   1 },
+    { "sched_roundrobin_workers",   check_sched,     &RoundRobin,   NWORKERS },
+    { "sched_workstealing",         check_sched,     &WorkStealing, 1 },
+    { "sched_workstealing_workers", check_sched,     &WorkStealing, NWORKERS },
+    { "sched_priority",             check_sched,     &Priority,     1 },
+    { "sched_priority_workers",     check_sched,     &Priority,     NWORKERS },
+    { "sched_stride",               check_sched,     &Stride,       1 },
+    { "sched_stride_workers",       check_sched,     &Stride,       NWORKERS },
+    { "sched_lottery",              check_sched,     &Lottery,      1 },
+    { "sched_lottery_workers",      check_sched,     &Lottery,      NWORKERS },
+    { "timer",                      check_timer,     NULL,          1 },
+    { "timer_workers",              check_timer,     NULL,          NWORKERS },
+    { "io",                         check_io,        NULL,          1 },
+    { "io_workers",                 check_io,        NULL,          NWORKERS },
+    { "outside",                    check_outside,   NULL,          1 },
+    { "outside_workers",            check_outside,   NULL,          NWORKERS },
+    { "growable_preempt",           check_growable_preempt, NULL, 1 },
+    { "stack_adapt",                check_stack_adapt, NULL, 1 },
+    { "stack_grow",                 check_stack_grow, NULL, 1 },
+    { "stack_grow_workers",         check_stack_grow, NULL, NWORKERS },
+    { "fp",                         check_fp,        NULL,          1 },
+    { "fp_workers",                 check_fp,        NULL,          NWORKERS },
+    { "fp_nofpu",                   check_fp_nofpu,  NULL,          1 },
+    { "fp_nofpu_workers",           check_fp_nofpu,  NULL,          NWORKERS },
+    { "sync",                       check_sync,      NULL,          1 },
+    { "sync_workers",               check_sync,      NULL,          NWORKERS },
+    { "chan",                       check_chan,      NULL,          1 },
+    { "chan_workers",               check_chan,      NULL,          NWORKERS },
+    { "create_many",                check_create_many, NULL, 1 },
+    { "create_many_workers",        check_create_many, NULL, NWORKERS },
+    { "sched_swap",                 check_sched_swap, NULL, 1 },
+    { "stats",                      check_stats,     NULL,          1 },
+    { "stats_workers",              check_stats,     NULL,          NWORKERS },
+    { "trace",                      check_trace,     NULL,          1 },
+    { "trace_workers",              check_trace,     NULL,          NWORKERS },
+    { "prio",                       check_prio,      &Priority,     1 },
+    { "share_stride",               check_share,     &Stride,       1 },
+    { "share_lottery",              check_share,     &Lottery,      1 },
+};
+
+// Runs one check in a fresh process; returns TRUE if it passed
+static int run_check(const check *c) {
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        check_name = c->name;
+        alarm(CHECK_TIMEOUT);
+        if (c->sched != NULL) {
+            lwp_set_scheduler(*c->sched);   // before the worker count
+        }
+        lwp_set_workers(c->workers);
+        lwp_start();
+        _exit(c->run() == 0 ? 0 : 1);
+    }
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        exit(1);
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        printf("%-32s ok\n", c->name);
+        return TRUE;
+    }
+    if (WIFSIGNALED(status)) {
+        printf("%-32s FAILED (signal %d%s)\n", c->name, WTERMSIG(status),
+               WTERMSIG(status) == SIGALRM ? ", timed out" : "");
+    } else {
+        printf("%-32s FAILED\n", c->name);
+    }
+    return FALSE;
+}
+
+// Whether a check was asked for on the command line
+static int wanted(const char *name, int argc, char *argv[]) {
+    int i;
+
+    if (argc < 2) {
+        return TRUE;
+    }
+    for (i = 1; i < argc; i++) {
+        if (strncmp(name, argv[i], strlen(argv[i])) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+int main(int argc, char *argv[]) {
+    int i, ran = 0, failed = 0;
+
+    for (i = 0; i < (int)(sizeof(checks) / sizeof(checks[0])); i++) {
+        if (wanted(checks[i].name, argc, argv)) {
+            ran++;
+            if (!run_check(&checks[i])) {
+                failed++;
+            }
+        }
+    }
+    if (ran == 0) {
+        fprintf(stderr, "usage: %s [name ...]\n", argv[0]);
+        return 1;
+    }
+    printf("%d of %d checks passed\n", ran - failed, ran);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+#ifndef LWPINTH
+#define LWPINTH
+#include "lwp.h"
+
+/* Interfaces between the library's own source files.  Not part of the
+ * public API; programs should only include lwp.h.
+ */
+
+/* io.c: the reactor.  lwp.c polls it when a worker runs out of threads
+ * (and every so often when it doesn't), and makes it return early when
+ * something lands in the inbox of a worker blocked in it.
+ */
+extern int  io_pending(void);           /* threads waiting on fds or time */
+extern int  io_poll(int max_ms);        /* wait for events; -1: no cap    */
+extern void io_wake(void);              /* interrupt a blocked io_poll()  */
+extern int  io_polling(void);           /* is any worker blocked in it?   */
+
+/* lwp.c: a thread that sees what it was waiting for may return, exit
+ * and be reaped at once, even while whoever published it is still on
+ * its way into lwp_unpark().  So a waker pins the thread before it
+ * publishes anything and unpins it once it's done unparking; reaping
+ * waits for every pin to go.
+ */
+extern void thread_pin(thread t);
+extern void thread_unpin(thread t);
+
+/* timer.c: the timer wheel.  A timer wakes the thread that started it
+ * with lwp_unpark() once it expires (pinning it around setting fired), and the reactor expires them, so a
+ * timer is usually a local of the thread waiting on it.
+ */
+typedef struct lwp_timer {
+  struct lwp_timer *next;               /* slot list                      */
+  struct lwp_timer **pprev;             /* what points at us; NULL if idle*/
+  unsigned long    expires;             /* in ticks (ms)                  */
+  int              level, slot;         /* where it's filed               */
+  thread           t;                   /* who to wake                    */
+  int              fired;               /* set (atomically) on expiry     */
+} lwp_timer;
+
+extern void timer_start(lwp_timer *tm, unsigned long usec);
+extern int  timer_cancel(lwp_timer *tm);  /* TRUE if it hadn't fired    */
+extern int  timer_pending(void);          /* any timers running?        */
+extern int  timer_expire(void);           /* fire what's due            */
+extern int  timer_next_ms(void);          /* until the next; -1: none   */
+
+/* trace.c: the event tracer (lwp_trace_start()).  Library code marks
+ * events with TRACE(), which is a load and a predicted branch while the
+ * tracer is off.
+ */
+#define TRACE_CREATE 1
+#define TRACE_RUN    2                  /* switched in                    */
+#define TRACE_STOP   3                  /* switched out                   */
+#define TRACE_BLOCK  4                  /* parked                         */
+#define TRACE_WAKE   5                  /* unparked                       */
+#define TRACE_EXIT   6
+
+typedef struct trace_event {
+  unsigned long long tsc;
+  tid_t            tid;                 /* whose event it is; 0: idle     */
+  int              worker;              /* where it happened              */
+  int              type;                /* TRACE_*; 0 while being written */
+} trace_event;
+
+/* lwp_trace_dump()'s file is one of these and then count trace_events,
+ * oldest first.  lwptrace turns it into Chrome trace JSON.
+ */
+#define TRACE_MAGIC "LWPTRC1"
+typedef struct trace_header {
+  char             magic[8];            /* TRACE_MAGIC                    */
+  double           ns_per_tick;         /* TSC rate while tracing         */
+  unsigned long long start_tsc;         /* when tracing started           */
+  unsigned long    count;
+} trace_header;
+
+extern int  trace_on;
+extern void trace_record(int type, tid_t tid, int worker);
+#define TRACE(type, tid, worker) do {                                   \
+    if (__builtin_expect(trace_on, 0)) trace_record(type, tid, worker); \
+  } while (0)
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * lwptrace: turns a file written by lwp_trace_dump() into Chrome trace
+ * JSON, for chrome://tracing or ui.perfetto.dev.
+ *
+ * usage: lwptrace tracefile > trace.json
+ *
+ * Every LWP gets a track of its own, named after its tid, with a slice
+ * for each stretch it spent running (labelled with the worker it ran
+ * on) and instant events where it was created, parked, woken and where
+ * it exited.  Worker idle loops aren't shown; the gaps are where they
+ * ran.  A slice whose start or end fell out of the ring is left out.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "lwpint.h"
+
+// What's running on each worker, from its last TRACE_RUN
+typedef struct slice {
+    tid_t              tid;     // NO_THREAD: nothing we saw start
+    unsigned long long start;
+} slice;
+
+static const char *instant_name(int type) {
+    switch (type) {
+    case TRACE_CREATE: return "create";
+    case TRACE_BLOCK:  return "park";
+    case TRACE_WAKE:   return "wake";
+    case TRACE_EXIT:   return "exit";
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    trace_header h;
+    trace_event e;
+    slice *running = NULL;
+    int nworkers = 0, first = TRUE;
+    unsigned long i;
+    FILE *f;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s tracefile\n", argv[0]);
+        return 1;
+    }
+    f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 ||
+        memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0) {
+        fprintf(stderr, "%s: not an lwp trace\n", argv[1]);
+        return 1;
+    }
+
+// Microseconds since tracing started, as Chrome wants them
+#define TS(tsc) (((double)(long long)((tsc) - h.start_tsc)) * \
+                 h.ns_per_tick / 1000.0)
+
+    printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (i = 0; i < h.count && fread(&e, sizeof(e), 1, f) == 1; i++) {
+        const char *name = instant_name(e.type);
+
+        if (e.tid == NO_THREAD || e.worker < 0) {
+            continue;  // a worker's idle loop
+        }
+        if (e.worker >= nworkers) {
+            int n = e.worker + 1;
+            slice *grown = realloc(running, n * sizeof(slice));
+            if (grown == NULL) {
+                perror("realloc");
+                return 1;
+            }
+            memset(grown + nworkers, 0, (n - nworkers) * sizeof(slice));
+            running = grown;
+            nworkers = n;
+        }
+
+        if (e.type == TRACE_RUN) {
+            running[e.worker].tid = e.tid;
+            running[e.worker].start = e.tsc;
+            continue;
+        }
+        if (e.type == TRACE_STOP) {
+            slice *s = &running[e.worker];
+            if (s->tid == e.tid) {
+                printf("%s{\"name\": \"worker %d\", \"ph\": \"X\", "
+                       "\"pid\": 1, \"tid\": %lu, \"ts\": %.3f, "
+                       "\"dur\": %.3f}", first ? "" : ",\n",
+                       e.worker, (unsigned long)e.tid, TS(s->start),
+                       TS(e.tsc) - TS(s->start));
+                first = FALSE;
+            }
+            s->tid = NO_THREAD;
+            continue;
+        }
+        if (name == NULL) {
+            continue;
+        }
+        printf("%s{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", "
+               "\"pid\": 1, \"tid\": %lu, \"ts\": %.3f, "
+               "\"args\": {\"worker\": %d}}", first ? "" : ",\n",
+               name, (unsigned long)e.tid, TS(e.tsc), e.worker);
+        first = FALSE;
+        if (e.type == TRACE_CREATE) {
+            printf(",\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+                   "\"pid\": 1, \"tid\": %lu, "
+                   "\"args\": {\"name\": \"lwp %lu\"}}",
+                   (unsigned long)e.tid, (unsigned long)e.tid);
+        }
+    }
+    printf("\n]}\n");
+    fclose(f);
+    free(running);
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include "lwp.h"
+#include <stddef.h>
+
+// Priority scheduler
+// One FIFO per priority level, each an intrusive circular list through
+// sched_one (next) and sched_two (prev) just like RoundRobin's, plus a
+// bitmap with a bit set for every non-empty level. next() finds the
+// highest non-empty level with a single count-leading-zeros and rotates
+// that level's head to its back, so threads of equal priority take
+// turns and every operation is O(1) regardless of thread count.
+//
+// Levels run from 0 (the default, lowest) to LWP_PRIO_LEVELS-1. Lower
+// levels only run when every higher one is empty. The state is per
+// kernel thread, so with several workers each one prioritises among its
+// own threads.
+
+static __thread thread level_head[LWP_PRIO_LEVELS];
+static __thread unsigned long long nonempty = 0;  // bit n: level n queued
+static __thread int queued = 0;
+
+static int level_of(thread t) {
+    int p = t->prio;
+    if (p < 0) return 0;
+    if (p >= LWP_PRIO_LEVELS) return LWP_PRIO_LEVELS - 1;
+    return p;
+}
+
+static void level_insert(thread t, int level) {
+    thread h = level_head[level];
+    if (!h) {
+        t->sched_one = t->sched_two = t;
+        level_head[level] = t;
+        nonempty |= 1ULL << level;
+    } else {  // at the back, i.e. just before the head
+        thread tail = h->sched_two;
+        tail->sched_one = t;
+        t->sched_two = tail;
+        t->sched_one = h;
+        h->sched_two = t;
+    }
+}
+
+static void level_unlink(thread t, int level) {
+    if (t->sched_one == t) {
+        level_head[level] = NULL;
+        nonempty &= ~(1ULL << level);
+    } else {
+        t->sched_two->sched_one = t->sched_one;
+        t->sched_one->sched_two = t->sched_two;
+        if (level_head[level] == t) level_head[level] = t->sched_one;
+    }
+    t->sched_one = t->sched_two = NULL;
+}
+
+
+void prio_admit(thread new) {
+    level_insert(new, level_of(new));
+    queued++;
+}
+
+
+void prio_remove(thread victim) {
+    if (victim->sched_one == NULL) return;  // not queued
+    level_unlink(victim, level_of(victim));
+    queued--;
+}
+
+
+thread prio_next(void) {
+    thread t;
+    int level;
+
+    if (!nonempty) return NULL;
+    level = 63 - __builtin_clzll(nonempty);
+    t = level_head[level];
+    level_head[level] = t->sched_one;  // back of its line
+    return t;
+}
+
+
+int prio_qlen(void) {
+    return queued;
+}
+
+
+// Hands everything over as one list, highest level first, by joining
+// the levels' lists end to end
+thread prio_drain(int *n) {
+    thread list = NULL;
+    int level;
+
+    while (nonempty) {
+        thread h;
+        level = 63 - __builtin_clzll(nonempty);
+        h = level_head[level];
+        if (list) {  // h's list goes after list's tail
+            thread tail = list->sched_two, h_tail = h->sched_two;
+            tail->sched_one = h;
+            h->sched_two = tail;
+            h_tail->sched_one = list;
+            list->sched_two = h_tail;
+        } else {
+            list = h;
+        }
+        level_head[level] = NULL;
+        nonempty &= ~(1ULL << level);
+    }
+    *n = queued;
+    queued = 0;
+    return list;
+}
+
+
+// t->prio has changed from old while t may be queued here
+void prio_reprio(thread t, int old) {
+    if (t->sched_one == NULL) return;
+    if (old < 0) old = 0;
+    if (old >= LWP_PRIO_LEVELS) old = LWP_PRIO_LEVELS - 1;
+    level_unlink(t, old);
+    level_insert(t, level_of(t));
+}
+
+
+struct scheduler prio_publish = {
+    NULL, NULL, prio_admit, prio_remove, prio_next, prio_qlen, prio_reprio,
+    NULL, prio_drain
+};
+scheduler Priority = &prio_publish;
@@ -0,0 +1,356 @@
+#include "lwp.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Proportional-share schedulers
+// Both give each thread CPU in proportion to its tickets (t->tickets,
+// LWP_DEFAULT_TICKETS when left at 0; see lwp_set_tickets()).
+//
+// Stride: every thread has a pass value, and each time it's picked its
+// pass advances by its stride, STRIDE1 / tickets. next() always picks
+// the smallest pass, so over any interval a thread with twice the
+// tickets runs twice as often, deterministically. Runnable threads sit
+// in a binary min-heap on pass (t->sched_pos is a thread's slot); as in
+// WorkStealing, the running thread is held outside the heap and charged
+// its stride when it yields. A thread that (re)joins the queue starts at
+// the current virtual time, so a thread that blocked for a while can't
+// come back and monopolise the CPU catching up.
+//
+// Lottery: a ticket is drawn at random on every next() and the thread
+// holding it runs. Shares are only right on average, but it needs no
+// per-thread history at all. Runnable threads sit in an array with a
+// Fenwick tree of their tickets over it, so a draw, an admit and a
+// remove are all O(log n).
+//
+// State is per kernel thread, as for the other schedulers.
+
+#define STRIDE1 (1UL << 20)
+
+static unsigned long stride_of(thread t) {
+    int tickets = t->tickets > 0 ? t->tickets : LWP_DEFAULT_TICKETS;
+    return STRIDE1 / tickets;
+}
+
+// A queue that can't grow would lose a runnable thread, so that's fatal
+static void out_of_memory(void) {
+    perror("Stride/Lottery");
+    exit(3);
+}
+
+static __thread thread *heap = NULL;
+static __thread int heap_len = 0;
+static __thread int heap_cap = 0;
+static __thread thread running = NULL;    // this worker's current thread
+static __thread unsigned long vtime = 0;  // pass of the last thread picked
+
+static void heap_set(int i, thread t) {
+    heap[i] = t;
+    t->sched_pos = i;
+}
+
+static void sift_up(int i) {
+    thread t = heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap[parent]->pass <= t->pass) break;
+        heap_set(i, heap[parent]);
+        i = parent;
+    }
+    heap_set(i, t);
+}
+
+static void sift_down(int i) {
+    thread t = heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= heap_len) break;
+        if (child + 1 < heap_len && heap[child + 1]->pass < heap[child]->pass) {
+            child++;
+        }
+        if (heap[child]->pass >= t->pass) break;
+        heap_set(i, heap[child]);
+        i = child;
+    }
+    heap_set(i, t);
+}
+
+static void heap_push(thread t) {
+    if (heap_len == heap_cap) {
+        int cap = heap_cap ? heap_cap * 2 : 64;
+        thread *bigger = realloc(heap, cap * sizeof(thread));
+        if (bigger == NULL) {
+            out_of_memory();
+        }
+        heap = bigger;
+        heap_cap = cap;
+    }
+    heap_set(heap_len++, t);
+    sift_up(heap_len - 1);
+}
+
+static void heap_delete(int i) {
+    thread last = heap[--heap_len];
+    if (i == heap_len) return;
+    heap_set(i, last);
+    if (i > 0 && heap[(i - 1) / 2]->pass > last->pass) {
+        sift_up(i);
+    } else {
+        sift_down(i);
+    }
+}
+
+
+void stride_shutdown(void) {
+    free(heap);
+    heap = NULL;
+    heap_len = heap_cap = 0;
+    running = NULL;
+}
+
+
+void stride_admit(thread new) {
+    if (new->pass < vtime) {
+        new->pass = vtime;
+    }
+    heap_push(new);
+}
+
+
+void stride_remove(thread victim) {
+    if (victim == running) {
+        running = NULL;
+    } else if (victim->sched_pos >= 0 && victim->sched_pos < heap_len &&
+               heap[victim->sched_pos] == victim) {
+        heap_delete(victim->sched_pos);
+    }
+}
+
+
+thread stride_next(void) {
+    thread t;
+
+    // The current thread used up a turn: charge it and put it back
+    if (running != NULL) {
+        running->pass += stride_of(running);
+        heap_push(running);
+        running = NULL;
+    }
+    if (heap_len == 0) {
+        return NULL;
+    }
+    t = heap[0];
+    heap_delete(0);
+    vtime = t->pass;
+    running = t;
+    return t;
+}
+
+
+int stride_qlen(void) {
+    return heap_len + (running != NULL);
+}
+
+
+struct scheduler stride_publish = {
+    NULL, stride_shutdown, stride_admit, stride_remove, stride_next,
+    stride_qlen, NULL, NULL, NULL
+};
+scheduler Stride = &stride_publish;
+
+
+// Lottery's array is 1-based, as the tree wants; t->sched_pos is a
+// thread's slot. The running thread stays in it. A slot holds the
+// tickets its thread had when they were last read (when it was admitted
+// or last ran), and sum is the tree's node for that slot: the total over
+// slots (i - lowbit(i), i].
+typedef struct lot_slot {
+    thread        t;
+    unsigned long tickets;
+    unsigned long sum;
+} lot_slot;
+
+static __thread lot_slot *lot = NULL;
+static __thread int lot_len = 0;
+static __thread int lot_cap = 0;              // slots, counting unused 0
+static __thread thread lot_running = NULL;    // what next() last picked
+static __thread unsigned long lot_seed = 0;
+
+// xorshift64*: plenty for drawing tickets
+static unsigned long lot_random(void) {
+    if (lot_seed == 0) {
+        lot_seed = 0x9E3779B97F4A7C15UL ^ (unsigned long)&lot_seed;
+    }
+    lot_seed ^= lot_seed >> 12;
+    lot_seed ^= lot_seed << 25;
+    lot_seed ^= lot_seed >> 27;
+    return lot_seed * 0x2545F4914F6CDD1DUL;
+}
+
+static unsigned long tickets_of(thread t) {
+    return t->tickets > 0 ? t->tickets : LWP_DEFAULT_TICKETS;
+}
+
+#define LOWBIT(i) ((i) & -(i))
+
+// Tickets in slots 1..i
+static unsigned long lot_prefix(int i) {
+    unsigned long total = 0;
+    for (; i > 0; i -= LOWBIT(i)) {
+        total += lot[i].sum;
+    }
+    return total;
+}
+
+// Adds delta (mod 2^n, so it may be "negative") to slot i's tickets
+static void lot_adjust(int i, unsigned long delta) {
+    lot[i].tickets += delta;
+    for (; i <= lot_len; i += LOWBIT(i)) {
+        lot[i].sum += delta;
+    }
+}
+
+static void lot_reserve(int n) {
+    if (n >= lot_cap) {
+        int cap = lot_cap ? lot_cap : 64;
+        lot_slot *bigger;
+        while (cap <= n) {
+            cap *= 2;
+        }
+        bigger = realloc(lot, cap * sizeof(lot_slot));
+        if (bigger == NULL) {
+            out_of_memory();
+        }
+        lot = bigger;
+        lot_cap = cap;
+    }
+}
+
+static void lot_append(thread t) {
+    int i;
+
+    lot_reserve(lot_len + 1);
+    i = ++lot_len;
+    lot[i].t = t;
+    lot[i].tickets = tickets_of(t);
+    lot[i].sum = lot[i].tickets + lot_prefix(i - 1) - lot_prefix(i - LOWBIT(i));
+    t->sched_pos = i;
+}
+
+// Empties slot i by moving the last thread into it
+static void lot_delete(int i) {
+    lot_slot *last = &lot[lot_len];
+
+    if (i != lot_len) {
+        lot_adjust(i, last->tickets - lot[i].tickets);
+        lot[i].t = last->t;
+        lot[i].t->sched_pos = i;
+    }
+    lot_len--;
+}
+
+static int lot_queued(thread t) {
+    return t->sched_pos >= 1 && t->sched_pos <= lot_len &&
+           lot[t->sched_pos].t == t;
+}
+
+
+void lottery_shutdown(void) {
+    free(lot);
+    lot = NULL;
+    lot_len = lot_cap = 0;
+    lot_running = NULL;
+}
+
+
+void lottery_admit(thread new) {
+    lot_append(new);
+}
+
+
+void lottery_remove(thread victim) {
+    if (victim == lot_running) {
+        lot_running = NULL;
+    }
+    if (lot_queued(victim)) {
+        lot_delete(victim->sched_pos);
+    }
+}
+
+
+thread lottery_next(void) {
+    unsigned long draw;
+    int pos = 0, step;
+
+    // Tickets can change at any time; pick up the last winner's
+    if (lot_running != NULL && lot_queued(lot_running)) {
+        int i = lot_running->sched_pos;
+        lot_adjust(i, tickets_of(lot_running) - lot[i].tickets);
+    }
+    lot_running = NULL;
+    if (lot_len == 0) {
+        return NULL;
+    }
+
+    // Walk down the tree to the slot holding ticket number draw
+    draw = lot_random() % lot_prefix(lot_len);
+    for (step = 1; step * 2 <= lot_len; step *= 2)
+        ;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= lot_len && lot[pos + step].sum <= draw) {
+            pos += step;
+            draw -= lot[pos].sum;
+        }
+    }
+    lot_running = lot[pos + 1].t;
+    return lot_running;
+}
+
+
+int lottery_qlen(void) {
+    return lot_len;
+}
+
+
+void lottery_admit_batch(thread list, int n) {
+    thread t = list;
+
+    if (!list) return;
+    lot_reserve(lot_len + n);
+    do {
+        thread next = t->sched_one;
+        lot_append(t);
+        t = next;
+    } while (t != list);
+}
+
+
+// Hands back the array as a batch list, in slot order
+thread lottery_drain(int *n) {
+    thread list = NULL;
+    int i;
+
+    for (i = 1; i <= lot_len; i++) {
+        thread t = lot[i].t;
+        if (!list) {
+            t->sched_one = t->sched_two = t;
+            list = t;
+        } else {
+            thread tail = list->sched_two;
+            tail->sched_one = t;
+            t->sched_two = tail;
+            t->sched_one = list;
+            list->sched_two = t;
+        }
+    }
+    *n = lot_len;
+    lot_len = 0;
+    lot_running = NULL;
+    return list;
+}
+
+
+struct scheduler lottery_publish = {
+    NULL, lottery_shutdown, lottery_admit, lottery_remove, lottery_next,
+    lottery_qlen, NULL, lottery_admit_batch, lottery_drain
+};
+scheduler Lottery = &lottery_publish;
@@ -0,0 +1,594 @@
+#include "lwpint.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Blocking synchronization for LWPs
+// Waiters are parked off the run queue (lwp_park()) on an intrusive
+// circular FIFO threaded through their lib_one (next) and lib_two (prev)
+// links, so a waiting thread costs the scheduler nothing. A thread is on
+// a wait queue exactly when its lib_one is non-NULL.
+//
+// Releasing hands the resource straight to the first waiter (the mutex
+// owner, or a semaphore unit) before unparking it, so a woken thread
+// never has to compete for what it was woken for and nothing can barge
+// in ahead of it. lwp_cond_signal() doesn't even wake its waiter unless
+// the mutex is free: it moves the waiter onto the mutex's queue, where
+// the next unlock hands it the mutex.
+//
+// Each object's queue is protected by a spinlock, held with preemption
+// masked and never across a park, so with several workers it only ever
+// spins for a handful of instructions.
+//
+// The timed variants park on a timer (timer.c) as well. When it fires
+// they take the lock and look again: if the resource was handed over in
+// the meantime they keep it, otherwise they take themselves off the
+// queue and report the timeout.
+
+static void spin_lock(int *lock) {
+    lwp_preempt_disable();
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+            __builtin_ia32_pause();
+        }
+    }
+}
+
+static void spin_unlock(int *lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+    lwp_preempt_enable();
+}
+
+// Appends t to the wait queue at *head
+static void wq_push(thread *head, thread t) {
+    if (!*head) {
+        t->lib_one = t->lib_two = t;
+        *head = t;
+    } else {  // just before the head
+        thread tail = (*head)->lib_two;
+        tail->lib_one = t;
+        t->lib_two = tail;
+        t->lib_one = *head;
+        (*head)->lib_two = t;
+    }
+}
+
+// Takes t off the wait queue at *head
+static void wq_remove(thread *head, thread t) {
+    if (t->lib_one == t) {
+        *head = NULL;
+    } else {
+        t->lib_two->lib_one = t->lib_one;
+        t->lib_one->lib_two = t->lib_two;
+        if (*head == t) *head = t->lib_one;
+    }
+    __atomic_store_n(&t->lib_one, NULL, __ATOMIC_RELEASE);
+    t->lib_two = NULL;
+}
+
+// Removes and returns the longest waiter, or NULL. It comes pinned
+// (thread_pin()), since taking it off the queue is already enough to
+// let it go; the caller must pass it to wq_wake() or thread_unpin().
+static thread wq_pop(thread *head) {
+    thread t = *head;
+    if (t) {
+        thread_pin(t);
+        wq_remove(head, t);
+    }
+    return t;
+}
+
+// Unparks a thread wq_pop() returned, and lets go of it
+static void wq_wake(thread t) {
+    lwp_unpark(t);
+    thread_unpin(t);
+}
+
+
+int lwp_mutex_init(lwp_mutex *m) {
+    m->lock = 0;
+    m->owner = NULL;
+    m->waiters = NULL;
+    return 0;
+}
+
+
+void lwp_mutex_lock(lwp_mutex *m) {
+    thread self = lwp_self();
+
+    spin_lock(&m->lock);
+    if (m->owner == NULL) {
+        m->owner = self;
+        spin_unlock(&m->lock);
+        return;
+    }
+    wq_push(&m->waiters, self);
+    spin_unlock(&m->lock);
+
+    // The unlocker makes us the owner before it unparks us
+    while (__atomic_load_n(&m->owner, __ATOMIC_ACQUIRE) != self) {
+        lwp_park();
+    }
+}
+
+
+// Returns 1 if the mutex was taken, 0 if it was still held after usec
+int lwp_mutex_timedlock(lwp_mutex *m, unsigned long usec) {
+    thread self = lwp_self();
+    lwp_timer tm;
+    int taken;
+
+    spin_lock(&m->lock);
+    if (m->owner == NULL || usec == 0) {
+        taken = m->owner == NULL;
+        if (taken) m->owner = self;
+        spin_unlock(&m->lock);
+        return taken;
+    }
+    wq_push(&m->waiters, self);
+    spin_unlock(&m->lock);
+
+    timer_start(&tm, usec);
+    while (__atomic_load_n(&m->owner, __ATOMIC_ACQUIRE) != self &&
+           !__atomic_load_n(&tm.fired, __ATOMIC_ACQUIRE)) {
+        lwp_park();
+    }
+    timer_cancel(&tm);
+
+    spin_lock(&m->lock);
+    taken = m->owner == self;
+    if (!taken) {
+        wq_remove(&m->waiters, self);
+    }
+    spin_unlock(&m->lock);
+    return taken;
+}
+
+
+// Returns 1 if the mutex was taken, 0 if it's held
+int lwp_mutex_trylock(lwp_mutex *m) {
+    int taken = 0;
+
+    spin_lock(&m->lock);
+    if (m->owner == NULL) {
+        m->owner = lwp_self();
+        taken = 1;
+    }
+    spin_unlock(&m->lock);
+    return taken;
+}
+
+
+void lwp_mutex_unlock(lwp_mutex *m) {
+    thread next;
+
+    spin_lock(&m->lock);
+    next = wq_pop(&m->waiters);
+    __atomic_store_n(&m->owner, next, __ATOMIC_RELEASE);
+    spin_unlock(&m->lock);
+    if (next) {
+        wq_wake(next);
+    }
+}
+
+
+int lwp_cond_init(lwp_cond *c) {
+    c->lock = 0;
+    c->mutex = NULL;
+    c->waiters = NULL;
+    return 0;
+}
+
+
+// Releases m, waits for a signal, and returns holding m again
+void lwp_cond_wait(lwp_cond *c, lwp_mutex *m) {
+    thread self = lwp_self();
+
+    spin_lock(&c->lock);
+    c->mutex = m;
+    wq_push(&c->waiters, self);
+    spin_unlock(&c->lock);
+
+    lwp_mutex_unlock(m);
+
+    // A signal moves us onto m's queue, so either way we're done once
+    // an unlock has handed us m
+    while (__atomic_load_n(&m->owner, __ATOMIC_ACQUIRE) != self) {
+        lwp_park();
+    }
+}
+
+
+// Moves one waiter from c to its mutex; returns FALSE if there were none
+static int cond_transfer(lwp_cond *c) {
+    lwp_mutex *m;
+    thread t;
+
+    spin_lock(&c->lock);
+    t = wq_pop(&c->waiters);
+    m = c->mutex;
+    spin_unlock(&c->lock);
+    if (t == NULL) {
+        return FALSE;
+    }
+
+    spin_lock(&m->lock);
+    if (m->owner == NULL) {
+        __atomic_store_n(&m->owner, t, __ATOMIC_RELEASE);
+        spin_unlock(&m->lock);
+        wq_wake(t);
+    } else {
+        wq_push(&m->waiters, t);
+        spin_unlock(&m->lock);
+        thread_unpin(t);
+    }
+    return TRUE;
+}
+
+
+void lwp_cond_signal(lwp_cond *c) {
+    cond_transfer(c);
+}
+
+
+void lwp_cond_broadcast(lwp_cond *c) {
+    while (cond_transfer(c))
+        ;
+}
+
+
+int lwp_sem_init(lwp_sem *s, int count) {
+    if (count < 0) {
+        return -1;
+    }
+    s->lock = 0;
+    s->count = count;
+    s->waiters = NULL;
+    return 0;
+}
+
+
+void lwp_sem_wait(lwp_sem *s) {
+    thread self = lwp_self();
+
+    spin_lock(&s->lock);
+    if (s->count > 0) {
+        s->count--;
+        spin_unlock(&s->lock);
+        return;
+    }
+    wq_push(&s->waiters, self);
+    spin_unlock(&s->lock);
+
+    // lwp_sem_post() takes us off the queue when it gives us its unit
+    while (__atomic_load_n(&self->lib_one, __ATOMIC_ACQUIRE) != NULL) {
+        lwp_park();
+    }
+}
+
+
+// Returns 1 if a unit was taken, 0 if there were none for usec
+int lwp_sem_timedwait(lwp_sem *s, unsigned long usec) {
+    thread self = lwp_self();
+    lwp_timer tm;
+    int taken;
+
+    spin_lock(&s->lock);
+    if (s->count > 0 || usec == 0) {
+        taken = s->count > 0;
+        if (taken) s->count--;
+        spin_unlock(&s->lock);
+        return taken;
+    }
+    wq_push(&s->waiters, self);
+    spin_unlock(&s->lock);
+
+    timer_start(&tm, usec);
+    while (__atomic_load_n(&self->lib_one, __ATOMIC_ACQUIRE) != NULL &&
+           !__atomic_load_n(&tm.fired, __ATOMIC_ACQUIRE)) {
+        lwp_park();
+    }
+    timer_cancel(&tm);
+
+    spin_lock(&s->lock);
+    taken = self->lib_one == NULL;
+    if (!taken) {
+        wq_remove(&s->waiters, self);
+    }
+    spin_unlock(&s->lock);
+    return taken;
+}
+
+
+// Returns 1 if a unit was taken, 0 if there were none
+int lwp_sem_trywait(lwp_sem *s) {
+    int taken = 0;
+
+    spin_lock(&s->lock);
+    if (s->count > 0) {
+        s->count--;
+        taken = 1;
+    }
+    spin_unlock(&s->lock);
+    return taken;
+}
+
+
+void lwp_sem_post(lwp_sem *s) {
+    thread next;
+
+    spin_lock(&s->lock);
+    next = wq_pop(&s->waiters);
+    if (next == NULL) {
+        s->count++;
+    }
+    spin_unlock(&s->lock);
+    if (next) {
+        wq_wake(next);
+    }
+}
+
+
+// Channels: a bounded ring of fixed-size elements with a wait queue on
+// each side. Every operation moves as many elements as it can in one go
+// and then wakes at most one thread on each side: the peer it just made
+// progress possible for, handed off so that it runs the moment we block
+// (lwp_handoff()), and one more of our own kind if there's still room
+// for it to get on with. A woken thread wakes the next in turn, so a
+// batch wakes as many threads as it can feed without waking a herd.
+struct lwp_chan {
+    int    lock;
+    int    closed;
+    size_t elemsize;
+    size_t capacity;
+    size_t head;      // oldest element
+    size_t count;
+    thread senders;   // waiting for room
+    thread receivers; // waiting for elements
+    char   *ring;
+};
+
+// The allocator isn't async-signal-safe, so preemption is masked around
+// it here as it is everywhere else in the library
+lwp_chan *lwp_chan_create(size_t elemsize, size_t capacity) {
+    lwp_chan *ch;
+
+    if (elemsize == 0 || capacity == 0) {
+        return NULL;
+    }
+    lwp_preempt_disable();
+    ch = calloc(1, sizeof(lwp_chan));
+    if (ch != NULL) {
+        ch->ring = malloc(elemsize * capacity);
+        if (ch->ring == NULL) {
+            free(ch);
+            ch = NULL;
+        }
+    }
+    lwp_preempt_enable();
+    if (ch == NULL) {
+        return NULL;
+    }
+    ch->elemsize = elemsize;
+    ch->capacity = capacity;
+    return ch;
+}
+
+
+// Frees a channel. Nothing may be blocked on it or use it afterwards.
+void lwp_chan_destroy(lwp_chan *ch) {
+    if (ch != NULL) {
+        lwp_preempt_disable();
+        free(ch->ring);
+        free(ch);
+        lwp_preempt_enable();
+    }
+}
+
+
+// Wakes everything blocked on ch. Sends fail from now on; receives
+// drain what's left and then fail.
+void lwp_chan_close(lwp_chan *ch) {
+    thread senders, receivers, t;
+
+    spin_lock(&ch->lock);
+    ch->closed = TRUE;
+    senders = ch->senders;
+    receivers = ch->receivers;
+    ch->senders = ch->receivers = NULL;
+    // Detach them all now; nobody can add to the lists once closed
+    while ((t = wq_pop(&senders)) != NULL) {
+        wq_wake(t);
+    }
+    while ((t = wq_pop(&receivers)) != NULL) {
+        wq_wake(t);
+    }
+    spin_unlock(&ch->lock);
+}
+
+// Copies n elements into the ring, which has room for them
+static void ring_put(lwp_chan *ch, const char *src, size_t n) {
+    size_t tail = (ch->head + ch->count) % ch->capacity;
+    size_t first = ch->capacity - tail < n ? ch->capacity - tail : n;
+
+    memcpy(ch->ring + tail * ch->elemsize, src, first * ch->elemsize);
+    memcpy(ch->ring, src + first * ch->elemsize, (n - first) * ch->elemsize);
+    ch->count += n;
+}
+
+// Copies the n oldest elements out of the ring
+static void ring_get(lwp_chan *ch, char *dst, size_t n) {
+    size_t first = ch->capacity - ch->head < n ? ch->capacity - ch->head : n;
+
+    memcpy(dst, ch->ring + ch->head * ch->elemsize, first * ch->elemsize);
+    memcpy(dst + first * ch->elemsize, ch->ring, (n - first) * ch->elemsize);
+    ch->head = (ch->head + n) % ch->capacity;
+    ch->count -= n;
+}
+
+// Waits on *queue, with ch locked, for as long as blocked() says so, or
+// if timed, for at most usec. Returns with ch locked and the caller off
+// the queue: 0, or LWP_TIMEOUT if it gave up.
+static int chan_block(lwp_chan *ch, thread *queue,
+                      int (*blocked)(lwp_chan *),
+                      int timed, unsigned long usec) {
+    thread self = lwp_self();
+    lwp_timer tm;
+    int armed = FALSE, result = 0;
+
+    while (!ch->closed && blocked(ch)) {
+        if (timed && (armed ? __atomic_load_n(&tm.fired, __ATOMIC_ACQUIRE)
+                            : usec == 0)) {
+            result = LWP_TIMEOUT;
+            break;
+        }
+        if (self->lib_one == NULL) {
+            wq_push(queue, self);
+        }
+        spin_unlock(&ch->lock);
+        if (timed && !armed) {  // only once we know we have to wait
+            timer_start(&tm, usec);
+            armed = TRUE;
+        }
+        lwp_park();
+        spin_lock(&ch->lock);
+    }
+    if (self->lib_one != NULL) {  // woken by something else
+        wq_remove(queue, self);
+    }
+    if (armed) {
+        timer_cancel(&tm);
+    }
+    return result;
+}
+
+static int chan_full(lwp_chan *ch) {
+    return ch->count == ch->capacity;
+}
+
+static int chan_empty(lwp_chan *ch) {
+    return ch->count == 0;
+}
+
+
+// Sends n elements, blocking while the channel is full, for at most usec
+// each time if timed. Returns how many were sent, which is fewer than n
+// only if the channel was closed, or LWP_TIMEOUT if it timed out before
+// sending any.
+static int chan_send(lwp_chan *ch, const char *src, int n,
+                     int timed, unsigned long usec) {
+    int sent = 0;
+
+    while (sent < n) {
+        thread peer, more = NULL;
+        size_t k;
+
+        spin_lock(&ch->lock);
+        if (chan_block(ch, &ch->senders, chan_full, timed, usec) != 0) {
+            spin_unlock(&ch->lock);
+            return sent ? sent : LWP_TIMEOUT;
+        }
+        if (ch->closed) {
+            spin_unlock(&ch->lock);
+            break;
+        }
+        k = ch->capacity - ch->count;
+        if (k > (size_t)(n - sent)) {
+            k = n - sent;
+        }
+        ring_put(ch, src + sent * ch->elemsize, k);
+        sent += k;
+        peer = wq_pop(&ch->receivers);
+        if (!chan_full(ch)) {
+            more = wq_pop(&ch->senders);
+        }
+        spin_unlock(&ch->lock);
+
+        if (more) {
+            wq_wake(more);
+        }
+        if (peer) {
+            lwp_handoff(peer);
+            thread_unpin(peer);
+        }
+    }
+    return sent;
+}
+
+
+// Receives between 1 and max elements, blocking while the channel is
+// empty, for at most usec if timed. Returns how many were received, 0
+// once it's closed and drained, or LWP_TIMEOUT.
+static int chan_recv(lwp_chan *ch, char *dst, int max,
+                     int timed, unsigned long usec) {
+    thread peer, more = NULL;
+    size_t k;
+
+    if (max <= 0) {
+        return 0;
+    }
+    spin_lock(&ch->lock);
+    if (chan_block(ch, &ch->receivers, chan_empty, timed, usec) != 0) {
+        spin_unlock(&ch->lock);
+        return LWP_TIMEOUT;
+    }
+    k = ch->count < (size_t)max ? ch->count : (size_t)max;
+    ring_get(ch, dst, k);
+    peer = k ? wq_pop(&ch->senders) : NULL;
+    if (!chan_empty(ch)) {
+        more = wq_pop(&ch->receivers);
+    }
+    spin_unlock(&ch->lock);
+
+    if (more) {
+        wq_wake(more);
+    }
+    if (peer) {
+        lwp_handoff(peer);
+        thread_unpin(peer);
+    }
+    return k;
+}
+
+
+// Sends n elements, blocking while the channel is full. Returns how many
+// were sent, which is fewer than n only if the channel was closed.
+int lwp_chan_send_batch(lwp_chan *ch, const void *elems, int n) {
+    return chan_send(ch, elems, n, FALSE, 0);
+}
+
+
+// Receives between 1 and max elements, blocking while the channel is
+// empty. Returns how many were received, 0 once it's closed and drained.
+int lwp_chan_recv_batch(lwp_chan *ch, void *elems, int max) {
+    return chan_recv(ch, elems, max, FALSE, 0);
+}
+
+
+// Sends one element; returns 0, or -1 if the channel is closed
+int lwp_chan_send(lwp_chan *ch, const void *elem) {
+    return chan_send(ch, elem, 1, FALSE, 0) == 1 ? 0 : -1;
+}
+
+
+// Receives one element; returns 0, or -1 if the channel is closed and
+// empty
+int lwp_chan_recv(lwp_chan *ch, void *elem) {
+    return chan_recv(ch, elem, 1, FALSE, 0) == 1 ? 0 : -1;
+}
+
+
+// Sends one element; returns 0, -1 if the channel is closed, or
+// LWP_TIMEOUT if it stayed full for usec
+int lwp_chan_send_timeout(lwp_chan *ch, const void *elem, unsigned long usec) {
+    int r = chan_send(ch, elem, 1, TRUE, usec);
+    return r == 1 ? 0 : r == LWP_TIMEOUT ? LWP_TIMEOUT : -1;
+}
+
+
+// Receives one element; returns 0, -1 if the channel is closed and
+// empty, or LWP_TIMEOUT if it stayed empty for usec
+int lwp_chan_recv_timeout(lwp_chan *ch, void *elem, unsigned long usec) {
+    int r = chan_recv(ch, elem, 1, TRUE, usec);
+    return r == 1 ? 0 : r == LWP_TIMEOUT ? LWP_TIMEOUT : -1;
+}
@@ -0,0 +1,262 @@
+#include "lwpint.h"
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+
+// Timer wheel
+// A hierarchical timing wheel with 1ms ticks: WHEEL_LEVELS levels of
+// WHEEL_SIZE slots, each level WHEEL_SIZE times coarser than the one
+// below. A timer goes into the finest level that can tell its expiry
+// apart from now; whenever a level comes round to slot 0 again, the next
+// level's current slot is cascaded down into it. Slots are doubly-linked
+// lists (next, and pprev pointing at whatever points at us), so starting
+// and cancelling a timer are both O(1), and a bitmap per level says
+// which slots are occupied so idle stretches are skipped a slot at a
+// time rather than a tick at a time.
+//
+// Four levels of 64 cover 2^24ms, about four and a half hours; anything
+// further out is parked in the top level and re-filed when it comes up.
+//
+// Everything here is under one lock, taken with preemption masked. A
+// timer wakes its thread with lwp_unpark(); the timer itself usually
+// lives on that thread's stack, so it's dead as soon as fired is set.
+
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN   (1UL << (WHEEL_BITS * WHEEL_LEVELS))
+
+static lwp_timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static unsigned long long occupied[WHEEL_LEVELS];  // bit n: slot n non-empty
+static unsigned long cur = 0;          // next tick to process
+static int active = 0;                 // timers in the wheel (atomic)
+static struct timespec epoch;          // tick 0
+static int started = FALSE;
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void wheel_enter(void) {
+    lwp_preempt_disable();
+    pthread_mutex_lock(&wheel_lock);
+}
+
+static void wheel_leave(void) {
+    pthread_mutex_unlock(&wheel_lock);
+    lwp_preempt_enable();
+}
+
+// Milliseconds since the epoch, with the lock held
+static unsigned long now_tick(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (!started) {
+        epoch = ts;
+        started = TRUE;
+    }
+    return ((ts.tv_sec - epoch.tv_sec) * 1000000000UL +
+            ts.tv_nsec - epoch.tv_nsec) / 1000000UL;
+}
+
+// Files tm into the slot for its expiry
+static void wheel_insert(lwp_timer *tm) {
+    unsigned long expires = tm->expires < cur ? cur : tm->expires;
+    unsigned long delta = expires - cur;
+    int level = 0, slot;
+
+    if (delta >= WHEEL_SPAN) {
+        expires = cur + WHEEL_SPAN - 1;  // re-filed when it gets there
+        delta = WHEEL_SPAN - 1;
+    }
+    while (delta >= (1UL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    tm->level = level;
+    tm->slot = slot;
+    tm->next = wheel[level][slot];
+    if (tm->next) {
+        tm->next->pprev = &tm->next;
+    }
+    tm->pprev = &wheel[level][slot];
+    wheel[level][slot] = tm;
+    occupied[level] |= 1ULL << slot;
+}
+
+static void wheel_unlink(lwp_timer *tm) {
+    *tm->pprev = tm->next;
+    if (tm->next) {
+        tm->next->pprev = tm->pprev;
+    }
+    if (wheel[tm->level][tm->slot] == NULL) {
+        occupied[tm->level] &= ~(1ULL << tm->slot);
+    }
+    tm->pprev = NULL;
+}
+
+// Moves everything in one slot down to where it belongs now
+static void cascade(int level, int slot) {
+    lwp_timer *tm = wheel[level][slot];
+
+    wheel[level][slot] = NULL;
+    occupied[level] &= ~(1ULL << slot);
+    while (tm != NULL) {
+        lwp_timer *next = tm->next;
+        wheel_insert(tm);
+        tm = next;
+    }
+}
+
+static int fire_slot(int slot) {
+    lwp_timer *tm = wheel[0][slot];
+    int fired = 0;
+
+    wheel[0][slot] = NULL;
+    occupied[0] &= ~(1ULL << slot);
+    while (tm != NULL) {
+        lwp_timer *next = tm->next;
+        thread t = tm->t;
+        tm->pprev = NULL;
+        thread_pin(t);  // it may be gone once it sees fired
+        __atomic_store_n(&tm->fired, TRUE, __ATOMIC_RELEASE);
+        lwp_unpark(t);
+        thread_unpin(t);
+        fired++;
+        tm = next;
+    }
+    __atomic_sub_fetch(&active, fired, __ATOMIC_RELAXED);
+    return fired;
+}
+
+
+// Arms tm to wake the calling thread (setting tm->fired) after at least
+// usec microseconds
+void timer_start(lwp_timer *tm, unsigned long usec) {
+    wheel_enter();
+    if (__atomic_load_n(&active, __ATOMIC_RELAXED) == 0) {
+        cur = now_tick();  // nobody's been turning an empty wheel
+    }
+    // +1: we're already partway through the current tick
+    tm->expires = now_tick() + (usec + 999) / 1000 + 1;
+    tm->t = lwp_self();
+    tm->fired = FALSE;
+    wheel_insert(tm);
+    __atomic_add_fetch(&active, 1, __ATOMIC_RELAXED);
+    wheel_leave();
+
+    // A worker blocked in the reactor is sleeping until the old earliest
+    // deadline, which may be later than this one
+    if (io_polling()) {
+        io_wake();
+    }
+}
+
+
+// Disarms tm. Returns TRUE if it hadn't fired yet.
+int timer_cancel(lwp_timer *tm) {
+    int pending;
+
+    if (__atomic_load_n(&tm->fired, __ATOMIC_ACQUIRE)) {
+        return FALSE;
+    }
+    wheel_enter();
+    pending = tm->pprev != NULL;
+    if (pending) {
+        wheel_unlink(tm);
+        __atomic_sub_fetch(&active, 1, __ATOMIC_RELAXED);
+    }
+    wheel_leave();
+    return pending;
+}
+
+
+int timer_pending(void) {
+    return __atomic_load_n(&active, __ATOMIC_RELAXED) != 0;
+}
+
+
+// Fires every timer that's due. Returns how many there were.
+int timer_expire(void) {
+    unsigned long target;
+    int fired = 0;
+
+    if (!timer_pending()) {
+        return 0;
+    }
+    wheel_enter();
+    target = now_tick();
+    while (cur <= target) {
+        int idx = cur & WHEEL_MASK;
+        int level;
+
+        // Coming round to slot 0 brings the next level's slot down, and
+        // so on up for as long as they're at 0 too
+        for (level = 1; idx == 0 && level < WHEEL_LEVELS; level++) {
+            int slot = (cur >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            cascade(level, slot);
+            if (slot != 0) break;
+        }
+
+        if (!(occupied[0] >> idx)) {
+            // Nothing more on this turn of level 0
+            unsigned long next = (cur | WHEEL_MASK) + 1;
+            cur = next < target + 1 ? next : target + 1;
+            continue;
+        }
+        if (occupied[0] & (1ULL << idx)) {
+            fired += fire_slot(idx);
+        }
+        cur++;
+    }
+    wheel_leave();
+    return fired;
+}
+
+
+// Finds the first tick, from cur on, at which timer_expire() will fire
+// (level 0) or cascade (higher levels) an occupied slot of level.
+// Returns FALSE if the level is empty.
+static int level_next(int level, unsigned long *tick) {
+    int shift = WHEEL_BITS * level, idx;
+    unsigned long unit = 1UL << shift;
+    unsigned long base = (cur + unit - 1) & ~(unit - 1);  // a slot boundary
+    unsigned long long bits = occupied[level];
+
+    if (bits == 0) {
+        return FALSE;
+    }
+    // Rotate so bit 0 is the slot base comes round to
+    idx = (base >> shift) & WHEEL_MASK;
+    if (idx != 0) {
+        bits = (bits >> idx) | (bits << (WHEEL_SIZE - idx));
+    }
+    *tick = base + __builtin_ctzll(bits) * unit;
+    return TRUE;
+}
+
+
+// Milliseconds until timer_expire() might next have something to do,
+// or -1 if there are no timers at all. That's the next occupied slot on
+// level 0 or the next cascade of an occupied slot further up, whichever
+// is sooner; a cascade that's due at cur (it hasn't been run yet) is 0.
+int timer_next_ms(void) {
+    unsigned long now, next = 0, tick;
+    int level, found = FALSE;
+
+    if (!timer_pending()) {
+        return -1;
+    }
+    wheel_enter();
+    now = now_tick();
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        if (level_next(level, &tick) && (!found || tick < next)) {
+            next = tick;
+            found = TRUE;
+        }
+    }
+    wheel_leave();
+    if (!found) {
+        return -1;  // cancelled while we looked
+    }
+    return next <= now ? 0 : (int)(next - now);
+}
@@ -0,0 +1,139 @@
+#include "lwpint.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Event tracer
+// While it's on, the library records thread creation, switches in and
+// out, parking, wakeups and exits into one ring for the whole process,
+// which keeps the most recent ring_mask+1 of them. Recording is a
+// fetch-and-add on head to claim a slot, a TSC read, and a few stores,
+// so it takes no locks and is safe from signal handlers (lwp_unpark()
+// records wakeups from anywhere). A slot's type is cleared while it's
+// being filled in and set last, and lwp_trace_dump() leaves out any it
+// finds still at 0; an event can still come out garbled if the ring
+// laps a writer that was interrupted halfway through.
+//
+// Timestamps stay in TSC ticks until lwptrace converts them, at the rate
+// measured between lwp_trace_start() and the dump.
+
+int trace_on = FALSE;
+static trace_event *ring = NULL;
+static unsigned long ring_mask = 0;
+static unsigned long head = 0;          // events ever recorded (atomic)
+static unsigned long long start_tsc;
+static struct timespec start_time;
+
+void trace_record(int type, tid_t tid, int worker) {
+    unsigned long i = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+    trace_event *e = &ring[i & ring_mask];
+
+    __atomic_store_n(&e->type, 0, __ATOMIC_RELAXED);
+    e->tsc = __builtin_ia32_rdtsc();
+    e->tid = tid;
+    e->worker = worker;
+    __atomic_store_n(&e->type, type, __ATOMIC_RELEASE);
+}
+
+
+// Starts tracing into a ring of the given number of events (rounded up
+// to a power of two; 0 for LWP_TRACE_EVENTS), discarding anything
+// recorded before. Returns 0, or -1 if there's no memory for the ring.
+// Resizing frees the old ring, so it mustn't be done while anything
+// could still be recording into it.
+int lwp_trace_start(size_t events) {
+    size_t size = 1024;
+
+    if (events == 0) {
+        events = LWP_TRACE_EVENTS;
+    }
+    while (size < events) {
+        size <<= 1;
+    }
+
+    __atomic_store_n(&trace_on, FALSE, __ATOMIC_SEQ_CST);
+    lwp_preempt_disable();
+    if (ring == NULL || ring_mask + 1 != size) {
+        trace_event *fresh = calloc(size, sizeof(trace_event));
+        if (fresh == NULL) {
+            lwp_preempt_enable();
+            return -1;
+        }
+        free(ring);
+        ring = fresh;
+        ring_mask = size - 1;
+    } else {
+        memset(ring, 0, size * sizeof(trace_event));
+    }
+    lwp_preempt_enable();
+
+    __atomic_store_n(&head, 0, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    start_tsc = __builtin_ia32_rdtsc();
+    __atomic_store_n(&trace_on, TRUE, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+// Stops recording. The ring is kept for lwp_trace_dump().
+void lwp_trace_stop(void) {
+    __atomic_store_n(&trace_on, FALSE, __ATOMIC_SEQ_CST);
+}
+
+
+// Writes what's in the ring to path, for lwptrace. It can be called with
+// the tracer on, but then events recorded meanwhile may be left out.
+// Returns 0, or -1 if there's nothing to dump or the file can't be
+// written.
+int lwp_trace_dump(const char *path) {
+    trace_header h;
+    trace_event *copy;
+    unsigned long first, last, i, n = 0;
+    struct timespec now;
+    double ns;
+    FILE *f;
+    int ok;
+
+    if (ring == NULL) {
+        return -1;
+    }
+
+    lwp_preempt_disable();
+    last = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    first = last > ring_mask + 1 ? last - (ring_mask + 1) : 0;
+    copy = malloc((last - first + 1) * sizeof(trace_event));
+    if (copy == NULL) {
+        lwp_preempt_enable();
+        return -1;
+    }
+    for (i = first; i < last; i++) {
+        trace_event *e = &ring[i & ring_mask];
+        int type = __atomic_load_n(&e->type, __ATOMIC_ACQUIRE);
+        if (type != 0) {
+            copy[n] = *e;
+            copy[n].type = type;
+            n++;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (now.tv_sec - start_time.tv_sec) * 1e9 +
+         (now.tv_nsec - start_time.tv_nsec);
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    h.ns_per_tick = ns / (double)(__builtin_ia32_rdtsc() - start_tsc);
+    h.start_tsc = start_tsc;
+    h.count = n;
+
+    f = fopen(path, "wb");
+    ok = f != NULL &&
+         fwrite(&h, sizeof(h), 1, f) == 1 &&
+         fwrite(copy, sizeof(trace_event), n, f) == n;
+    if (f != NULL && fclose(f) != 0) {
+        ok = FALSE;
+    }
+    free(copy);
+    lwp_preempt_enable();
+    return ok ? 0 : -1;
+}
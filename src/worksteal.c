@@ -0,0 +1,221 @@
+#include "lwp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Work-stealing scheduler
+// Every worker has a Chase-Lev deque of runnable threads. The owner
+// pushes at the bottom; threads are taken from the top, by the owner
+// (so that lwp_yield() still rotates fairly through its threads) and by
+// idle workers stealing from busy ones. The running thread is not on
+// any deque, so nobody can steal it out from under its worker; next()
+// puts it back at the bottom when it yields.
+//
+// The library only ever removes the thread that is currently running
+// (it blocked or exited), which is all ws_remove supports.
+//
+// init sizes the deque array from lwp_get_workers(). lwp_start() calls
+// it again once the number is final, and it grows the array then if
+// lwp_set_workers() raised it after this scheduler was selected.
+
+// A deque that can't grow would lose a runnable thread, so that's fatal
+static void out_of_memory(void) {
+    perror("WorkStealing");
+    exit(3);
+}
+
+typedef struct ws_array {
+    long size;                // power of two
+    struct ws_array *retired; // older, smaller arrays (thieves may still
+                              // be reading them, so they're kept)
+    thread buf[1];
+} ws_array;
+
+typedef struct ws_deque {
+    long top __attribute__((aligned(64)));     // thieves and owner take here
+    long bottom __attribute__((aligned(64)));  // owner pushes here
+    ws_array *array;
+} ws_deque;
+
+#define WS_INITIAL_SIZE 64
+
+static ws_deque *deques = NULL;
+static int ndeques = 0;
+static __thread thread running = NULL;  // this worker's current thread
+
+static ws_array *ws_array_new(long size) {
+    ws_array *a = malloc(sizeof(ws_array) + (size - 1) * sizeof(thread));
+    if (a) {
+        a->size = size;
+        a->retired = NULL;
+    }
+    return a;
+}
+
+// Owner only: doubles the array, copying over the live range [t, b)
+static ws_array *ws_grow(ws_deque *d, ws_array *a, long t, long b) {
+    ws_array *bigger = ws_array_new(a->size * 2);
+    long i;
+    if (!bigger) {
+        return NULL;
+    }
+    for (i = t; i < b; i++) {
+        bigger->buf[i & (bigger->size - 1)] = a->buf[i & (a->size - 1)];
+    }
+    bigger->retired = a;
+    __atomic_store_n(&d->array, bigger, __ATOMIC_RELEASE);
+    return bigger;
+}
+
+// Owner only: adds t at the bottom
+static void ws_push(ws_deque *d, thread t) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    ws_array *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+
+    if (b - top > a->size - 1) {
+        ws_array *bigger = ws_grow(d, a, top, b);
+        if (!bigger) {
+            out_of_memory();
+        }
+        a = bigger;
+    }
+    __atomic_store_n(&a->buf[b & (a->size - 1)], t, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+// Anyone: takes the oldest thread from the top, or NULL if the deque is
+// empty or another taker won the race
+static thread ws_take(ws_deque *d) {
+    long t, b;
+    ws_array *a;
+    thread x;
+
+    t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) {
+        return NULL;
+    }
+    a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    x = __atomic_load_n(&a->buf[t & (a->size - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, FALSE,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return x;
+}
+
+static long ws_size(ws_deque *d) {
+    long n = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE) -
+             __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    return n > 0 ? n : 0;
+}
+
+static ws_deque *my_deque(void) {
+    int id = lwp_worker_id();
+
+    if (id >= ndeques) {
+        fprintf(stderr, "WorkStealing: no deque for worker %d of %d\n",
+                id, ndeques);
+        abort();
+    }
+    return &deques[id];
+}
+
+
+// Only ever grows the array, and only before lwp_start() has started
+// the other workers, so nobody can be stealing from it meanwhile
+void ws_init(void) {
+    int want = lwp_get_workers(), i;
+    ws_deque *grown;
+
+    if (ndeques >= want) {
+        return;
+    }
+    grown = realloc(deques, want * sizeof(ws_deque));
+    if (grown == NULL) {
+        out_of_memory();
+    }
+    memset(grown + ndeques, 0, (want - ndeques) * sizeof(ws_deque));
+    for (i = ndeques; i < want; i++) {
+        grown[i].array = ws_array_new(WS_INITIAL_SIZE);
+        if (grown[i].array == NULL) {
+            out_of_memory();
+        }
+    }
+    deques = grown;
+    ndeques = want;
+}
+
+
+void ws_shutdown(void) {
+    int i;
+
+    for (i = 0; deques != NULL && i < ndeques; i++) {
+        ws_array *a = deques[i].array;
+        while (a != NULL) {
+            ws_array *older = a->retired;
+            free(a);
+            a = older;
+        }
+    }
+    free(deques);
+    deques = NULL;
+    ndeques = 0;
+}
+
+
+void ws_admit(thread new) {
+    ws_init();  // in case nobody went through lwp_set_scheduler()
+    ws_push(my_deque(), new);
+}
+
+
+void ws_remove(thread victim) {
+    if (victim == running) {
+        running = NULL;
+    }
+}
+
+
+thread ws_next(void) {
+    ws_deque *mine = my_deque();
+    int self = lwp_worker_id();
+    thread t;
+    int i, tries;
+
+    // The current thread is yielding: back of the line
+    if (running != NULL) {
+        ws_push(mine, running);
+        running = NULL;
+    }
+
+    t = ws_take(mine);
+    if (t == NULL) {
+        // Steal from the others, starting with our neighbour. A failed
+        // take may only mean we lost a race, so give each deque that
+        // still looks non-empty a couple of chances.
+        for (i = 1; i < ndeques && t == NULL; i++) {
+            ws_deque *victim = &deques[(self + i) % ndeques];
+            for (tries = 0; tries < 2 && t == NULL && ws_size(victim); tries++) {
+                t = ws_take(victim);
+            }
+        }
+    }
+    running = t;
+    return t;
+}
+
+
+int ws_qlen(void) {
+    return ws_size(my_deque()) + (running != NULL);
+}
+
+
+struct scheduler ws_publish = {
+    ws_init, ws_shutdown, ws_admit, ws_remove, ws_next, ws_qlen, NULL,
+    NULL, NULL
+};
+scheduler WorkStealing = &ws_publish;